@@ -4,6 +4,24 @@
 // Copyright 2016 whitequark
 //-----------------------------------------------------------------------------
 #include "solvespace.h"
+#if !defined(WIN32)
+#include <sys/resource.h>
+#endif
+
+// The peak memory use of the process so far, in kilobytes, if we can tell.
+static long PeakMemoryUse() {
+#if defined(WIN32)
+    return 0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
 
 static bool RunBenchmark(std::function<void()> setupFn,
                          std::function<bool()> benchFn,
@@ -18,9 +36,9 @@ static bool RunBenchmark(std::function<void()> setupFn,
     teardownFn();
 
     // Benchmark
-    size_t iter = 0;
+    std::vector<double> times;
     double time = 0.0;
-    while(iter < minIter || time < minTime) {
+    while(times.size() < minIter || time < minTime) {
         setupFn();
         auto testStartTime = std::chrono::steady_clock::now();
         benchFn();
@@ -29,28 +47,154 @@ static bool RunBenchmark(std::function<void()> setupFn,
 
         std::chrono::duration<double> testTime = testEndTime - testStartTime;
         time += testTime.count();
-        iter += 1;
+        times.push_back(testTime.count());
     }
+    std::sort(times.begin(), times.end());
+    size_t iter = times.size();
 
     // Report
     fprintf(stdout, "Iterations: %zd\n", iter);
     fprintf(stdout, "Time:       %.3f s\n", time);
-    fprintf(stdout, "Per iter.:  %.3f s\n", time / (double)iter);
+    fprintf(stdout, "Per iter.:  %.3f ms\n", time / (double)iter * 1e3);
+    fprintf(stdout, "Median:     %.3f ms\n", times[iter / 2] * 1e3);
+    fprintf(stdout, "95th pct.:  %.3f ms\n", times[(iter * 95 - 1) / 100] * 1e3);
+    long memory = PeakMemoryUse();
+    if(memory > 0) {
+        fprintf(stdout, "Peak mem.:  %ld KiB\n", memory);
+    }
 
     return true;
 }
 
+//-----------------------------------------------------------------------------
+// Synthetic sketches for the solver benchmarks, all in the default workplane
+// and starting a little away from their solution, so that solving them takes
+// a few Newton steps:
+//   chain:<n>       n segments of fixed length, joined end to end;
+//   grid:<n>        an n by n grid of horizontal and vertical segments, with
+//                   all the segments that meet at each node coincident;
+//   circles:<m>x<n> an m by n array of circles of fixed diameter, with the
+//                   centers evenly spaced along the first row, and along
+//                   each column from there.
+// Returns the point to drag, or no entity if the description is bad.
+//-----------------------------------------------------------------------------
+static hEntity CreateSketch(const std::string &sketch) {
+    unsigned m = 0, n = 0;
+    if(sscanf(sketch.c_str(), "chain:%u", &n) == 1 && n > 0) {
+        hEntity prev = Entity::NO_ENTITY;
+        for(unsigned i = 0; i < n; i++) {
+            hRequest hr = SS.GW.AddRequest(Request::Type::LINE_SEGMENT,
+                                           /*rememberForUndo=*/false);
+            hEntity ptA = hr.entity(1),
+                    ptB = hr.entity(2);
+            SK.GetEntity(ptA)->PointForceTo(Vector::From(i * 10.0, (i % 2) * 1.0, 0));
+            SK.GetEntity(ptB)->PointForceTo(Vector::From(i * 10.0 + 9.0, 0.5, 0));
+
+            hConstraint hc = Constraint::Constrain(Constraint::Type::PT_PT_DISTANCE,
+                                                   ptA, ptB, Entity::NO_ENTITY);
+            SK.GetConstraint(hc)->valA = 10.0;
+            if(prev.v) {
+                Constraint::ConstrainCoincident(prev, ptA);
+            }
+            prev = ptB;
+        }
+        return prev;
+    } else if(sscanf(sketch.c_str(), "grid:%u", &n) == 1 && n > 0) {
+        // The first point at each node, which the others are made
+        // coincident with.
+        std::vector<hEntity> node((n + 1) * (n + 1), Entity::NO_ENTITY);
+        auto nodeAt = [&](unsigned i, unsigned j) {
+            return Vector::From(i * 10.0 + ((i * 7 + j * 3) % 5) * 0.1,
+                                j * 10.0 + ((i * 3 + j * 7) % 5) * 0.1, 0);
+        };
+        auto addSegment = [&](unsigned i, unsigned j, bool horizontal) {
+            unsigned ie = horizontal ? i + 1 : i,
+                     je = horizontal ? j : j + 1;
+            hRequest hr = SS.GW.AddRequest(Request::Type::LINE_SEGMENT,
+                                           /*rememberForUndo=*/false);
+            hEntity pts[2] = { hr.entity(1), hr.entity(2) };
+            SK.GetEntity(pts[0])->PointForceTo(nodeAt(i, j));
+            SK.GetEntity(pts[1])->PointForceTo(nodeAt(ie, je));
+            Constraint::Constrain(horizontal ? Constraint::Type::HORIZONTAL
+                                             : Constraint::Type::VERTICAL,
+                                  Entity::NO_ENTITY, Entity::NO_ENTITY, hr.entity(0));
+            if((horizontal && j == 0) || (!horizontal && i == 0)) {
+                hConstraint hc = Constraint::Constrain(Constraint::Type::PT_PT_DISTANCE,
+                                                       pts[0], pts[1], Entity::NO_ENTITY);
+                SK.GetConstraint(hc)->valA = 10.0;
+            }
+            unsigned at[2] = { j * (n + 1) + i, je * (n + 1) + ie };
+            for(int k = 0; k < 2; k++) {
+                if(node[at[k]].v) {
+                    Constraint::ConstrainCoincident(node[at[k]], pts[k]);
+                } else {
+                    node[at[k]] = pts[k];
+                }
+            }
+        };
+        for(unsigned j = 0; j <= n; j++) {
+            for(unsigned i = 0; i <= n; i++) {
+                if(i < n) addSegment(i, j, /*horizontal=*/true);
+                if(j < n) addSegment(i, j, /*horizontal=*/false);
+            }
+        }
+        return node.back();
+    } else if(sscanf(sketch.c_str(), "circles:%ux%u", &m, &n) == 2 && m > 0 && n > 0) {
+        std::vector<hEntity> center(m * n);
+        for(unsigned j = 0; j < n; j++) {
+            for(unsigned i = 0; i < m; i++) {
+                hRequest hr = SS.GW.AddRequest(Request::Type::CIRCLE,
+                                               /*rememberForUndo=*/false);
+                hEntity hc = hr.entity(1);
+                SK.GetEntity(hc)->PointForceTo(
+                    Vector::From(i * 10.0 + (i % 3) * 0.2, j * 10.0 + (j % 3) * 0.2, 0));
+                SK.GetEntity(hr.entity(64))->DistanceForceTo(2.0 + (i + j) % 2);
+
+                hConstraint hd = Constraint::Constrain(Constraint::Type::DIAMETER,
+                                                       Entity::NO_ENTITY, Entity::NO_ENTITY,
+                                                       hr.entity(0));
+                SK.GetConstraint(hd)->valA = 5.0;
+                if(j == 0 && i > 0) {
+                    hEntity prev = center[j * m + i - 1];
+                    Constraint::Constrain(Constraint::Type::HORIZONTAL,
+                                          prev, hc, Entity::NO_ENTITY);
+                    hConstraint hl = Constraint::Constrain(Constraint::Type::PT_PT_DISTANCE,
+                                                           prev, hc, Entity::NO_ENTITY);
+                    SK.GetConstraint(hl)->valA = 10.0;
+                }
+                if(j > 0) {
+                    hEntity prev = center[(j - 1) * m + i];
+                    Constraint::Constrain(Constraint::Type::VERTICAL,
+                                          prev, hc, Entity::NO_ENTITY);
+                    hConstraint hl = Constraint::Constrain(Constraint::Type::PT_PT_DISTANCE,
+                                                           prev, hc, Entity::NO_ENTITY);
+                    SK.GetConstraint(hl)->valA = 10.0;
+                }
+                center[j * m + i] = hc;
+            }
+        }
+        return center.back();
+    }
+    fprintf(stderr, "Unknown sketch \"%s\"\n", sketch.c_str());
+    return Entity::NO_ENTITY;
+}
+
 int main(int argc, char **argv) {
     std::vector<std::string> args = InitPlatform(argc, argv);
 
     std::string mode;
     Platform::Path filename;
+    std::string sketch;
     if(args.size() == 3) {
         mode = args[1];
         filename = Platform::Path::From(args[2]);
+        sketch = args[2];
     } else {
         fprintf(stderr, "Usage: %s [mode] [filename]\n", args[0].c_str());
+        fprintf(stderr, "       %s [solver mode] [sketch]\n", args[0].c_str());
         fprintf(stderr, "Mode can be one of: load.\n");
+        fprintf(stderr, "Solver mode can be one of: solve, drag, find-bad.\n");
+        fprintf(stderr, "Sketch can be one of: chain:<n>, grid:<n>, circles:<m>x<n>.\n");
         return 1;
     }
 
@@ -70,6 +214,62 @@ int main(int argc, char **argv) {
                 SK.Clear();
                 SS.Clear();
             });
+    } else if(mode == "solve" || mode == "drag" || mode == "find-bad") {
+        // Each of these builds the sketch, and then times only the solver:
+        //   solve     solves it, as after a change to some dimension;
+        //   drag      solves it once, and then times a drag of one point
+        //             through a few steps, each solved as in the UI;
+        //   find-bad  adds a redundant constraint, and times the solve that
+        //             finds which constraints could be removed.
+        const int dragSteps = 10;
+        hEntity dragged;
+        result = RunBenchmark(
+            [&] {
+                SS.Init();
+                dragged = CreateSketch(sketch);
+                if(!dragged.v) return;
+
+                Group *g = SK.GetGroup(SS.GW.activeGroup);
+                if(mode == "solve") {
+                    g->dofCheckOk = true;
+                } else if(mode == "drag") {
+                    SS.SolveGroup(g->h, /*andFindFree=*/false);
+                } else if(mode == "find-bad") {
+                    Constraint c = *SK.constraint.Last();
+                    c.h = {};
+                    Constraint::AddConstraint(&c, /*rememberForUndo=*/false);
+                }
+            },
+            [&] {
+                if(!dragged.v)
+                    return false;
+
+                hGroup hg = SS.GW.activeGroup;
+                if(mode == "drag") {
+                    SS.GW.pending.point = dragged;
+                    for(int i = 0; i < dragSteps; i++) {
+                        Entity *pt = SK.GetEntity(dragged);
+                        pt->PointForceTo(pt->PointGetNum().Plus(Vector::From(0.5, 0.2, 0)));
+                        SS.SolveGroup(hg, /*andFindFree=*/false);
+                        if(SK.GetGroup(hg)->solved.how != SolveResult::OKAY)
+                            return false;
+                    }
+                    return true;
+                }
+
+                SS.SolveGroup(hg, /*andFindFree=*/false);
+                SolveResult how = SK.GetGroup(hg)->solved.how;
+                if(mode == "find-bad") {
+                    return how == SolveResult::REDUNDANT_OKAY &&
+                           SK.GetGroup(hg)->solved.remove.n > 0;
+                }
+                return how == SolveResult::OKAY;
+            },
+            [] {
+                SS.GW.pending.point = Entity::NO_ENTITY;
+                SK.Clear();
+                SS.Clear();
+            });
     } else {
         fprintf(stderr, "Unknown mode \"%s\"\n", mode.c_str());
     }
@@ -135,6 +135,37 @@ typedef struct {
 } Slvs_Constraint;
 
 
+/* What the solver did, and where it spent its time; to see which systems
+ * are slow, and why. Times are in milliseconds. */
+typedef struct {
+    int                 equations;
+    int                 params;
+    /* The params eliminated by substitution, e.g. for coincident points */
+    int                 substituted;
+    /* The equations that were solved alone, each for a single param */
+    int                 alone;
+    /* The independent systems that the rest of the equations fall apart
+     * into, and the number of equations in the largest of them */
+    int                 systems;
+    int                 largestSystem;
+
+    /* The Newton steps taken, in all the systems together */
+    int                 iterations;
+    /* The largest error in any equation, before the first step and after
+     * each one, in the system that took the most steps. The caller should
+     * allocate the array residual[], and pass its size in residuals; the
+     * solver sets residuals to the number of values, and writes as many
+     * of them as fit. If residual is NULL, then nothing is written. */
+    double              *residual;
+    int                 residuals;
+
+    double              writeJacobianTime;
+    double              evalJacobianTime;
+    double              solveTime;
+    double              rankTime;
+    double              totalTime;
+} Slvs_SolveStats;
+
 typedef struct {
     /*** INPUT VARIABLES
      *
@@ -184,16 +215,102 @@ typedef struct {
     /* The solver indicates the number of unconstrained degrees of freedom. */
     int                 dof;
 
-    /* The solver indicates whether the solution succeeded. */
+    /* The solver indicates whether the solution succeeded. There is no
+     * limit on the size of a group, so SLVS_RESULT_TOO_MANY_UNKNOWNS is
+     * never returned; it remains defined for compatibility. If an entity
+     * or constraint has an unknown type, or refers to a handle that isn't
+     * in the system, then nothing is solved, and the result is
+     * SLVS_RESULT_INVALID. */
 #define SLVS_RESULT_OKAY                0
 #define SLVS_RESULT_INCONSISTENT        1
 #define SLVS_RESULT_DIDNT_CONVERGE      2
 #define SLVS_RESULT_TOO_MANY_UNKNOWNS   3
+#define SLVS_RESULT_INVALID             4
     int                 result;
 } Slvs_System;
 
 DLL void Slvs_Solve(Slvs_System *sys, Slvs_hGroup hg);
 
+/* Slvs_Solve() works on one set of tables inside the library, so only one
+ * solve may be in progress at a time. A context owns its own tables
+ * instead, so solves in different contexts may run at the same time, on
+ * different threads; but a context may be used by only one thread at a
+ * time. */
+typedef struct Slvs_Context Slvs_Context;
+
+DLL Slvs_Context *Slvs_CreateContext(void);
+DLL void Slvs_DestroyContext(Slvs_Context *ctx);
+DLL void Slvs_SolveInContext(Slvs_Context *ctx, Slvs_System *sys, Slvs_hGroup hg);
+
+/* A context can also keep a system loaded between solves, which is much
+ * faster when the same system is solved many times with small changes;
+ * the work to set up the solve is kept too, for as long as the equations
+ * stay the same. Slvs_LoadSystem() copies the params, entities, and
+ * constraints from sys, replacing anything loaded before. Then params may
+ * be changed, and constraints added or removed, by handle. The params are
+ * solved in place; Slvs_SolveLoaded() takes dragged[] and calculateFaileds
+ * from sys, and writes dof, result, failed[], and the values of the params
+ * in param[] (if any) back to sys, but doesn't look at its entities or
+ * constraints.
+ *
+ * The functions that return an int return SLVS_RESULT_OKAY, or else
+ * SLVS_RESULT_INVALID and change nothing: if a handle isn't loaded, if
+ * a constraint to add is invalid as in Slvs_System or its handle is
+ * taken, or if a system to load is invalid, in which case nothing is left
+ * loaded. Slvs_SolveLoaded() likewise gives SLVS_RESULT_INVALID if a param
+ * in sys isn't loaded. */
+DLL int Slvs_LoadSystem(Slvs_Context *ctx, const Slvs_System *sys);
+DLL int Slvs_SetParam(Slvs_Context *ctx, Slvs_hParam h, double val);
+DLL int Slvs_GetParam(Slvs_Context *ctx, Slvs_hParam h, double *val);
+DLL int Slvs_AddConstraint(Slvs_Context *ctx, const Slvs_Constraint *c);
+DLL int Slvs_RemoveConstraint(Slvs_Context *ctx, Slvs_hConstraint h);
+DLL void Slvs_SolveLoaded(Slvs_Context *ctx, Slvs_System *sys, Slvs_hGroup hg);
+
+/* By default, the solver takes full Newton steps. If damped is true, then
+ * every solve in ctx from now on limits its steps to a trust region
+ * (dogleg), and takes a step only if it reduces the error in the
+ * constraints. That converges more reliably from starting points far
+ * from a solution, and fails sooner when there's none. */
+DLL void Slvs_SetDamped(Slvs_Context *ctx, int damped);
+
+/* Describe what the solver did in the last solve in ctx, in stats. */
+DLL void Slvs_GetSolveStats(Slvs_Context *ctx, Slvs_SolveStats *stats);
+
+/* Solve the system in sys for each of several scenarios, which differ only
+ * in the values of some params, and in the values (valA) of some
+ * constraints. The work to set up the solve is shared by all of the
+ * scenarios, and they're solved in parallel. Each scenario is started
+ * from the solution of the one before it in the batch, so it helps to put
+ * similar scenarios next to each other. */
+typedef struct {
+    int                 scenarios;
+
+    /* The params to set for each scenario; in scenario i, param[j] has
+     * the value paramVal[i*params + j]. */
+    int                 params;
+    Slvs_hParam         *param;
+    double              *paramVal;
+
+    /* Likewise, the constraints whose valA to set for each scenario */
+    int                 constraints;
+    Slvs_hConstraint    *constraint;
+    double              *constraintVal;
+
+    /* The solver writes the solved values of the params in sys, in the
+     * same order, to solution[i*sys->params] onwards; and the result, as
+     * in Slvs_System, to result[i]. If sys is invalid, or param[] or
+     * constraint[] has a handle that isn't in it, then every result is
+     * SLVS_RESULT_INVALID, and every solution is the values in sys. */
+    double              *solution;
+    int                 *result;
+
+    /* If damped is true, then the scenarios are solved as in a context
+     * with Slvs_SetDamped(). */
+    int                 damped;
+} Slvs_Batch;
+
+DLL void Slvs_SolveBatch(const Slvs_System *sys, Slvs_hGroup hg, Slvs_Batch *batch);
+
 
 /* Our base coordinate system has basis vectors
  *     (1, 0, 0)  (0, 1, 0)  (0, 0, 1)
@@ -338,11 +338,45 @@ struct CompareId {
 
 // A list, where each element has an integer identifier. The list is kept
 // sorted by that identifier, and items can be looked up in log n time by
-// id.
+// id; or in constant time, typically, once the list is big enough to index.
 template <class T, class H>
 class IdList {
     T *elem            = nullptr;
     int elemsAllocated = 0;
+    // While adding in bulk, new items just go at the end of the list, which
+    // is sorted and checked for duplicate handles only by EndBulkAdd().
+    bool bulk          = false;
+
+    // A handle is mostly the handle of whatever generated it, shifted up
+    // 16 bits, plus a small index; so we index the items by that top half.
+    // The items with handles in [k << 16, (k+1) << 16) are elem[bucket[k]]
+    // to elem[bucket[k+1]-1], and within that range, their low halves are
+    // often consecutive. This is built when first needed, kept up to date
+    // as items are added, and rebuilt after anything else changes the list.
+    std::vector<int> bucket;
+    enum { MIN_ITEMS_TO_INDEX = 64 };
+    // Bumped whenever items are added, removed, or moved around, so that
+    // anything indexing the items by position can tell when to rebuild.
+    uint32_t changes   = 0;
+
+    // Not worth it for a short list, or if the handles are so sparse that
+    // most buckets would be empty.
+    bool WorthIndexing(size_t buckets) const {
+        return n >= MIN_ITEMS_TO_INDEX && buckets <= 4*(size_t)n;
+    }
+
+    bool BuildIndex() {
+        size_t buckets = (size_t)(Last()->h.v >> 16) + 1;
+        if(!WorthIndexing(buckets)) return false;
+
+        bucket.resize(buckets + 1);
+        int i = 0;
+        for(size_t k = 0; k <= buckets; k++) {
+            while(i < n && (size_t)(elem[i].h.v >> 16) < k) i++;
+            bucket[k] = i;
+        }
+        return true;
+    }
 public:
     int n = 0;
 
@@ -352,6 +386,10 @@ public:
         return n == 0;
     }
 
+    uint32_t Changes() const {
+        return changes;
+    }
+
     void AllocForOneMore() {
         if(n >= elemsAllocated) {
             ReserveMore((elemsAllocated + 32)*2 - n);
@@ -359,6 +397,7 @@ public:
     }
 
     uint32_t MaximumId() {
+        ssassert(!bulk, "Unexpected search of a list while adding in bulk");
         if(IsEmpty()) {
             return 0;
         } else {
@@ -368,12 +407,15 @@ public:
 
     H AddAndAssignId(T *t) {
         t->h.v = (MaximumId() + 1);
+        // That's bigger than any handle that we have, so it goes straight
+        // at the end.
         Add(t);
 
         return t->h;
     }
 
     T * LowerBound(T const& t) {
+        ssassert(!bulk, "Unexpected search of a list while adding in bulk");
         if(IsEmpty()) {
             return nullptr;
         }
@@ -382,6 +424,7 @@ public:
     }
 
     T * LowerBound(H const& h) {
+        ssassert(!bulk, "Unexpected search of a list while adding in bulk");
         if(IsEmpty()) {
             return nullptr;
         }
@@ -411,17 +454,59 @@ public:
         }
     }
 
-    void Add(T *t) {
+    void Add(const T *t) {
         AllocForOneMore();
+        changes++;
+
+        // Items are mostly added in order of handle, so most go at the end;
+        // and when adding in bulk, they all do for now.
+        if(bulk || IsEmpty() || Last()->h.v < t->h.v) {
+            new(&elem[n]) T(*t);
+            ++n;
+            if(!bucket.empty()) {
+                size_t buckets = (size_t)(t->h.v >> 16) + 1;
+                if(WorthIndexing(buckets)) {
+                    bucket.resize(std::max(bucket.size(), buckets + 1), n - 1);
+                    bucket.back() = n;
+                } else {
+                    bucket.clear();
+                }
+            }
+            return;
+        }
 
         // Look to see if we already have something with the same handle value.
-        ssassert(FindByIdNoOops(t->h) == nullptr, "Handle isn't unique");
+        int i = LowerBoundIndex(*t);
+        ssassert(elem[i].h.v != t->h.v, "Handle isn't unique");
 
-        // Copy-construct at the end of the list.
+        // Copy-construct at the end of the list, and move it into place.
         new(&elem[n]) T(*t);
         ++n;
-        // The item we just added is trivially sorted, so "merge"
-        std::inplace_merge(begin(), end() - 1, end(), Compare());
+        std::rotate(begin() + i, end() - 1, end());
+        for(size_t k = (t->h.v >> 16) + 1; k < bucket.size(); k++) {
+            bucket[k]++;
+        }
+    }
+
+    // Add many items with Add(), without the cost of keeping the list sorted
+    // after each one; the list mustn't be searched until EndBulkAdd().
+    void BeginBulkAdd() {
+        bulk = true;
+        bucket.clear();
+    }
+    void EndBulkAdd() {
+        bulk = false;
+        changes++;
+        // Whatever was in order already, typically all the items from
+        // before BeginBulkAdd() and many after, needn't be sorted again.
+        T *sorted = std::is_sorted_until(begin(), end(), Compare());
+        if(sorted != end()) {
+            std::sort(sorted, end(), Compare());
+            std::inplace_merge(begin(), sorted, end(), Compare());
+        }
+        ssassert(std::adjacent_find(begin(), end(), [](T const &a, T const &b) {
+                     return a.h.v == b.h.v;
+                 }) == end(), "Handle isn't unique");
     }
 
     T *FindById(H h) {
@@ -446,6 +531,19 @@ public:
         if(IsEmpty()) {
             return nullptr;
         }
+        if(!bulk && n >= MIN_ITEMS_TO_INDEX && (!bucket.empty() || BuildIndex())) {
+            size_t k = h.v >> 16;
+            if(k + 1 >= bucket.size()) return nullptr;
+            T *first = &elem[bucket[k]], *last = &elem[bucket[k + 1]];
+            if(first == last || h.v < first->h.v) return nullptr;
+
+            size_t guess = h.v - first->h.v;
+            if(guess < (size_t)(last - first) && first[guess].h.v == h.v) {
+                return &first[guess];
+            }
+            auto it = std::lower_bound(first, last, h, Compare());
+            return (it != last && it->h.v == h.v) ? it : nullptr;
+        }
         auto it = LowerBound(h);
         if (it == nullptr || it == end()) {
             return nullptr;
@@ -491,11 +589,14 @@ public:
         }
     }
 
-    void RemoveTagged() {
+    // Remove every item for which remove(item) is true, in one pass; and
+    // return how many that was.
+    template<typename F>
+    int RemoveIf(F remove) {
         int src, dest;
         dest = 0;
         for(src = 0; src < n; src++) {
-            if(elem[src].tag) {
+            if(remove(elem[src])) {
                 // this item should be deleted
                 elem[src].Clear();
             } else {
@@ -507,8 +608,17 @@ public:
         }
         for(int i = dest; i < n; i++)
             elem[i].~T();
+        int removed = n - dest;
         n = dest;
         // and elemsAllocated is untouched, because we didn't resize
+        if(removed > 0) {
+            bucket.clear();
+            changes++;
+        }
+        return removed;
+    }
+    void RemoveTagged() {
+        RemoveIf([](T &t) { return t.tag != 0; });
     }
     void RemoveById(H h) {
         ClearTags();
@@ -521,6 +631,10 @@ public:
         std::swap(l->elem, elem);
         std::swap(l->elemsAllocated, elemsAllocated);
         std::swap(l->n, n);
+        std::swap(l->bulk, bulk);
+        std::swap(l->bucket, bucket);
+        l->changes++;
+        changes++;
     }
 
     void DeepCopyInto(IdList<T,H> *l) {
@@ -530,6 +644,7 @@ public:
             new(&l->elem[i]) T(elem[i]);
         l->elemsAllocated = elemsAllocated;
         l->n = n;
+        l->bucket = bucket;
     }
 
     void Clear() {
@@ -540,6 +655,8 @@ public:
         if(elem) MemFree(elem);
         elem = NULL;
         elemsAllocated = n = 0;
+        bucket.clear();
+        changes++;
     }
 
 };
@@ -560,6 +677,36 @@ public:
     void Solve();
 };
 
+// A sparse, symmetric, positive semidefinite matrix (like the A*A' that
+// we form for the least squares solve), which we factor as L*D*L'.
+class SparseSymmetricMatrix {
+public:
+    struct Entry {
+        int     col;
+        double  v;
+    };
+
+    int n;
+    std::vector<double>               diag;
+    // The off-diagonal entries of each row, sorted by column; both the
+    // upper and lower triangles are stored.
+    std::vector<std::vector<Entry>>   row;
+
+    // The factorization; the pivots in the order that we eliminated them,
+    // and for each pivot its D and the corresponding column of L. A pivot
+    // whose D was too small to use has D = 0.
+    std::vector<int>                  order;
+    std::vector<int>                  pivot;  // position of each index in order
+    std::vector<double>               d;
+    std::vector<std::vector<Entry>>   l;
+
+    void Clear(int n);
+    int Factor(double tol);
+    void Solve(double *x) const;
+    void NullVector(int i, double *x) const;
+    double InverseQuadratic(const std::vector<Entry> &b, double *work) const;
+};
+
 #define RGBi(r, g, b) RgbaColor::From((r), (g), (b))
 #define RGBf(r, g, b) RgbaColor::FromFloat((float)(r), (float)(g), (float)(b))
 
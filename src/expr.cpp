@@ -400,25 +400,13 @@ Expr *Expr::PartialWrt(hParam p) const {
     ssassert(false, "Unexpected operation");
 }
 
-uint64_t Expr::ParamsUsed() const {
-    uint64_t r = 0;
-    if(op == Op::PARAM)     r |= ((uint64_t)1 << (parh.v % 61));
-    if(op == Op::PARAM_PTR) r |= ((uint64_t)1 << (parp->h.v % 61));
+void Expr::ParamsUsedList(std::vector<hParam> *list) const {
+    if(op == Op::PARAM)     list->push_back(parh);
+    if(op == Op::PARAM_PTR) list->push_back(parp->h);
 
     int c = Children();
-    if(c >= 1)          r |= a->ParamsUsed();
-    if(c >= 2)          r |= b->ParamsUsed();
-    return r;
-}
-
-bool Expr::DependsOn(hParam p) const {
-    if(op == Op::PARAM)     return (parh    == p);
-    if(op == Op::PARAM_PTR) return (parp->h == p);
-
-    int c = Children();
-    if(c == 1)          return a->DependsOn(p);
-    if(c == 2)          return a->DependsOn(p) || b->DependsOn(p);
-    return false;
+    if(c >= 1)          a->ParamsUsedList(list);
+    if(c >= 2)          b->ParamsUsedList(list);
 }
 
 bool Expr::Tol(double a, double b) {
@@ -464,6 +452,14 @@ Expr *Expr::FoldConstants() {
             if(op == Op::TIMES && n->a->op == Op::CONSTANT && Tol(n->a->v, 1)) {
                 *n = *(n->b); break;
             }
+            // x - x = 0, for the same param on both sides; substitution can
+            // leave these behind, and then the partials are exactly zero
+            if(op == Op::MINUS && n->a->op == n->b->op &&
+               ((n->a->op == Op::PARAM     && n->a->parh == n->b->parh) ||
+                (n->a->op == Op::PARAM_PTR && n->a->parp == n->b->parp)))
+            {
+                n->op = Op::CONSTANT; n->v = 0; break;
+            }
             // 0*x = x*0 = 0
             if(op == Op::TIMES && n->b->op == Op::CONSTANT && Tol(n->b->v, 0)) {
                 n->op = Op::CONSTANT; n->v = 0; break;
@@ -491,55 +487,489 @@ Expr *Expr::FoldConstants() {
     return n;
 }
 
-void Expr::Substitute(hParam oldh, hParam newh) {
-    ssassert(op != Op::PARAM_PTR, "Expected an expression that refer to params via handles");
+//-----------------------------------------------------------------------------
+// Compile expressions into a tape, and evaluate that tape. Each instruction
+// does exactly what Expr::Eval() would for its node, so the results are
+// identical, just faster to get.
+//-----------------------------------------------------------------------------
+void ExprTape::Clear() {
+    code.clear();
+    value.clear();
+    output.clear();
+    needs.clear();
+    compiled.clear();
+    valueCode.clear();
+    visited.clear();
+}
+
+size_t ExprTape::KeyHash::operator()(const Key &k) const {
+    size_t h = std::hash<uint32_t>()((uint32_t)k.op);
+    h = h*31 + std::hash<int>()(k.a);
+    h = h*31 + std::hash<int>()(k.b);
+    h = h*31 + std::hash<Param *>()(k.p);
+    h = h*31 + std::hash<uint64_t>()(k.v);
+    return h;
+}
+
+int ExprTape::Compile(const Expr *e) {
+    Key k = {};
+    k.op = e->op;
+    k.a  = -1;
+    k.b  = -1;
+    switch(e->op) {
+        case Expr::Op::PARAM:
+            k.op = Expr::Op::PARAM_PTR;
+            k.p  = SK.GetParam(e->parh);
+            break;
+
+        case Expr::Op::PARAM_PTR:
+            k.p  = e->parp;
+            break;
+
+        case Expr::Op::CONSTANT:
+            memcpy(&k.v, &e->v, sizeof(k.v));
+            break;
+
+        case Expr::Op::VARIABLE: ssassert(false, "Not supported yet");
+
+        case Expr::Op::PLUS:
+        case Expr::Op::TIMES:
+            k.a = Compile(e->a);
+            k.b = Compile(e->b);
+            // These commute exactly, so a+b is the same as b+a.
+            if(k.a > k.b) std::swap(k.a, k.b);
+            break;
+
+        case Expr::Op::MINUS:
+        case Expr::Op::DIV:
+            k.a = Compile(e->a);
+            k.b = Compile(e->b);
+            break;
+
+        case Expr::Op::NEGATE:
+        case Expr::Op::SQRT:
+        case Expr::Op::SQUARE:
+        case Expr::Op::SIN:
+        case Expr::Op::COS:
+        case Expr::Op::ASIN:
+        case Expr::Op::ACOS:
+            k.a = Compile(e->a);
+            break;
+    }
+
+    auto it = compiled.find(k);
+    if(it != compiled.end()) return it->second;
+
+    int dest = (int)value.size();
+    if(k.op == Expr::Op::CONSTANT) {
+        value.push_back(e->v);
+        valueCode.push_back(-1);
+    } else {
+        Instruction i = {};
+        i.op   = k.op;
+        i.dest = dest;
+        i.a    = k.a;
+        i.b    = k.b;
+        i.p    = k.p;
+        if(i.p) i.h = i.p->h;
+        value.push_back(0.0);
+        valueCode.push_back((int)code.size());
+        code.push_back(i);
+    }
+    compiled[k] = dest;
+    return dest;
+}
+
+int ExprTape::Add(const Expr *e) {
+    Output o;
+    o.value = Compile(e);
+    o.start = (int)needs.size();
+
+    // Find the instructions that this expression needs; they're in order
+    // once sorted, since an instruction never comes before its operands.
+    int mark = (int)output.size() + 1;
+    visited.resize(code.size(), 0);
+    std::vector<int> stack;
+    if(valueCode[o.value] >= 0) stack.push_back(valueCode[o.value]);
+    while(!stack.empty()) {
+        int c = stack.back();
+        stack.pop_back();
+        if(visited[c] == mark) continue;
+        visited[c] = mark;
+        needs.push_back(c);
+
+        const Instruction &i = code[c];
+        if(i.op == Expr::Op::PARAM_PTR) continue;
+        if(i.a >= 0 && valueCode[i.a] >= 0) stack.push_back(valueCode[i.a]);
+        if(i.b >= 0 && valueCode[i.b] >= 0) stack.push_back(valueCode[i.b]);
+    }
+    std::sort(needs.begin() + o.start, needs.end());
+    o.end = (int)needs.size();
+
+    output.push_back(o);
+    return (int)output.size() - 1;
+}
+
+void ExprTape::Eval(double *out) {
+    double *x = value.data();
+    for(const Instruction &i : code) {
+        double r;
+        switch(i.op) {
+            case Expr::Op::PARAM_PTR:   r = i.p->val; break;
+
+            case Expr::Op::PLUS:        r = x[i.a] + x[i.b]; break;
+            case Expr::Op::MINUS:       r = x[i.a] - x[i.b]; break;
+            case Expr::Op::TIMES:       r = x[i.a] * x[i.b]; break;
+            case Expr::Op::DIV:         r = x[i.a] / x[i.b]; break;
+
+            case Expr::Op::NEGATE:      r = -x[i.a]; break;
+            case Expr::Op::SQRT:        r = sqrt(x[i.a]); break;
+            case Expr::Op::SQUARE:      r = x[i.a] * x[i.a]; break;
+            case Expr::Op::SIN:         r = sin(x[i.a]); break;
+            case Expr::Op::COS:         r = cos(x[i.a]); break;
+            case Expr::Op::ACOS:        r = acos(x[i.a]); break;
+            case Expr::Op::ASIN:        r = asin(x[i.a]); break;
+
+            default: ssassert(false, "Unexpected operation");
+        }
+        x[i.dest] = r;
+    }
+    for(size_t k = 0; k < output.size(); k++) {
+        out[k] = x[output[k].value];
+    }
+}
 
-    if(op == Op::PARAM && parh == oldh) {
-        parh = newh;
+//-----------------------------------------------------------------------------
+// Point the params back in to the param tables, which may have been rebuilt
+// since we compiled the tape; they're found the same way as in
+// DeepCopyWithParamsAsPointers().
+//-----------------------------------------------------------------------------
+void ExprTape::Rebind(IdList<Param,hParam> *firstTry, IdList<Param,hParam> *thenTry) {
+    for(Instruction &i : code) {
+        if(i.op != Expr::Op::PARAM_PTR) continue;
+        i.p = firstTry->FindByIdNoOops(i.h);
+        if(!i.p) i.p = thenTry->FindById(i.h);
     }
-    int c = Children();
-    if(c >= 1) a->Substitute(oldh, newh);
-    if(c >= 2) b->Substitute(oldh, newh);
+    // The old pointers mean nothing now, so don't try to reuse anything
+    // compiled with them.
+    compiled.clear();
 }
 
+
 //-----------------------------------------------------------------------------
-// If the expression references only one parameter that appears in pl, then
-// return that parameter. If no param is referenced, then return NO_PARAMS.
-// If multiple params are referenced, then return MULTIPLE_PARAMS.
+// Group the expressions of a tape by shape, and evaluate each group for all
+// of its expressions at once. Each expression still gets exactly the same
+// operations as in the tape, in the same order, so the results are identical.
 //-----------------------------------------------------------------------------
-const hParam Expr::NO_PARAMS       = { 0 };
-const hParam Expr::MULTIPLE_PARAMS = { 1 };
-hParam Expr::ReferencedParams(ParamList *pl) const {
-    if(op == Op::PARAM) {
-        if(pl->FindByIdNoOops(parh)) {
-            return parh;
+void ExprBatch::Clear() {
+    code.clear();
+    output.clear();
+    value.clear();
+    adjoint.clear();
+    param.clear();
+    paramCode.clear();
+    partial.clear();
+    shape.clear();
+}
+
+void ExprBatch::Build(const ExprTape &tape,
+        std::function<int(int output, const ExprTape::Instruction &i)> partialIndex)
+{
+    Clear();
+
+    // What each expression reads, as indices into the tape: its constants,
+    // in order of their rows, from consts[firstConst]; and its instructions
+    // that read params, in order of their columns, from params[firstParam].
+    struct Lane {
+        int shape, lane;
+        int firstConst, firstParam;
+    };
+    std::vector<Lane> laneOf(tape.output.size());
+    std::vector<int> consts, params;
+    // The rows of the s-th shape's constants, constRows[firstConstRow[s]]
+    // to constRows[firstConstRow[s+1]-1]
+    std::vector<int> constRows, firstConstRow;
+
+    std::unordered_map<std::string, int> shapeOf;
+    std::vector<int> row(tape.value.size(), -1);
+    std::string key;
+    for(size_t k = 0; k < tape.output.size(); k++) {
+        const ExprTape::Output &o = tape.output[k];
+        Lane &ln = laneOf[k];
+        ln.firstConst = (int)consts.size();
+        ln.firstParam = (int)params.size();
+
+        // Number the values that this expression needs in the order that
+        // we meet them; anything that isn't computed yet is a constant. The
+        // shape is then everything about the code except the constants' values
+        // and the params.
+        int rows = 0;
+        auto rowOf = [&](int v) {
+            if(row[v] < 0) {
+                row[v] = rows++;
+                consts.push_back(v);
+            }
+            return row[v];
+        };
+        key.clear();
+        int start = (int)code.size();
+        for(int n = o.start; n < o.end; n++) {
+            const ExprTape::Instruction &ti = tape.code[tape.needs[n]];
+            ExprTape::Instruction i = {};
+            i.op = ti.op;
+            switch(ti.op) {
+                case Expr::Op::PARAM_PTR:
+                    i.a = (int)params.size() - ln.firstParam;
+                    params.push_back(tape.needs[n]);
+                    break;
+
+                case Expr::Op::PLUS:
+                case Expr::Op::MINUS:
+                case Expr::Op::TIMES:
+                case Expr::Op::DIV:
+                    i.a = rowOf(ti.a);
+                    i.b = rowOf(ti.b);
+                    break;
+
+                default:
+                    i.a = rowOf(ti.a);
+                    break;
+            }
+            i.dest = rows++;
+            row[ti.dest] = i.dest;
+            code.push_back(i);
+            int word[3] = { (int)i.op, i.a, i.b };
+            key.append((const char *)word, sizeof(word));
+        }
+        int result = rowOf(o.value);
+        key.append((const char *)&result, sizeof(result));
+
+        auto it = shapeOf.find(key);
+        if(it == shapeOf.end()) {
+            Shape s = {};
+            s.start  = start;
+            s.end    = (int)code.size();
+            s.rows   = rows;
+            s.params = (int)params.size() - ln.firstParam;
+            s.result = result;
+            firstConstRow.push_back((int)constRows.size());
+            for(size_t j = ln.firstConst; j < consts.size(); j++) {
+                constRows.push_back(row[consts[j]]);
+            }
+            it = shapeOf.emplace(key, (int)shape.size()).first;
+            shape.push_back(s);
         } else {
-            return NO_PARAMS;
+            // We have this code already.
+            code.resize(start);
+        }
+        ln.shape = it->second;
+        ln.lane  = shape[ln.shape].lanes++;
+
+        for(size_t j = ln.firstConst; j < consts.size(); j++) {
+            row[consts[j]] = -1;
+        }
+        for(int n = o.start; n < o.end; n++) {
+            row[tape.code[tape.needs[n]].dest] = -1;
         }
     }
-    ssassert(op != Op::PARAM_PTR, "Expected an expression that refer to params via handles");
 
-    int c = Children();
-    if(c == 0) {
-        return NO_PARAMS;
-    } else if(c == 1) {
-        return a->ReferencedParams(pl);
-    } else if(c == 2) {
-        hParam pa, pb;
-        pa = a->ReferencedParams(pl);
-        pb = b->ReferencedParams(pl);
-        if(pa == NO_PARAMS) {
-            return pb;
-        } else if(pb == NO_PARAMS) {
-            return pa;
-        } else if(pa == pb) {
-            return pa; // either, doesn't matter
-        } else {
-            return MULTIPLE_PARAMS;
+    firstConstRow.push_back((int)constRows.size());
+
+    int outputs = 0, values = 0, columns = 0;
+    for(Shape &s : shape) {
+        s.first = outputs;
+        s.value = values;
+        s.param = columns;
+        outputs += s.lanes;
+        values  += s.rows * s.lanes;
+        columns += s.params * s.lanes;
+    }
+    output.resize(outputs);
+    value.assign(values, 0.0);
+    adjoint.assign(values, 0.0);
+    param.resize(columns);
+    paramCode.resize(columns);
+    partial.resize(columns);
+
+    for(size_t k = 0; k < tape.output.size(); k++) {
+        const Lane &ln = laneOf[k];
+        const Shape &s = shape[ln.shape];
+        int l = ln.lane, lanes = s.lanes;
+        output[s.first + l] = (int)k;
+        for(int j = firstConstRow[ln.shape]; j < firstConstRow[ln.shape + 1]; j++) {
+            int v = consts[ln.firstConst + j - firstConstRow[ln.shape]];
+            value[s.value + constRows[j] * lanes + l] = tape.value[v];
+        }
+        for(int j = 0; j < s.params; j++) {
+            int c = params[ln.firstParam + j];
+            int w = s.param + j * lanes + l;
+            param[w]     = tape.code[c].p;
+            paramCode[w] = c;
+            partial[w]   = partialIndex((int)k, tape.code[c]);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Evaluate every expression, writing the k-th to out[k]. If partials is not
+// NULL then also differentiate them, writing each partial to the index given
+// for it when we were built; as in a reverse sweep over each expression's
+// instructions, except that instead of skipping an instruction with a zero
+// adjoint we leave its operands' adjoints as they were.
+//-----------------------------------------------------------------------------
+void ExprBatch::Eval(double *out, double *partials) {
+    for(const Shape &s : shape) {
+        int lanes = s.lanes;
+        double *x = &value[s.value];
+        for(int c = s.start; c < s.end; c++) {
+            const ExprTape::Instruction &i = code[c];
+            double *r = x + i.dest * lanes;
+            const double *a = x + i.a * lanes, *b = x + i.b * lanes;
+            switch(i.op) {
+                case Expr::Op::PARAM_PTR: {
+                    Param **p = &param[s.param + i.a * lanes];
+                    for(int l = 0; l < lanes; l++) r[l] = p[l]->val;
+                    break;
+                }
+
+                case Expr::Op::PLUS:
+                    for(int l = 0; l < lanes; l++) r[l] = a[l] + b[l];
+                    break;
+                case Expr::Op::MINUS:
+                    for(int l = 0; l < lanes; l++) r[l] = a[l] - b[l];
+                    break;
+                case Expr::Op::TIMES:
+                    for(int l = 0; l < lanes; l++) r[l] = a[l] * b[l];
+                    break;
+                case Expr::Op::DIV:
+                    for(int l = 0; l < lanes; l++) r[l] = a[l] / b[l];
+                    break;
+
+                case Expr::Op::NEGATE:
+                    for(int l = 0; l < lanes; l++) r[l] = -a[l];
+                    break;
+                case Expr::Op::SQRT:
+                    for(int l = 0; l < lanes; l++) r[l] = sqrt(a[l]);
+                    break;
+                case Expr::Op::SQUARE:
+                    for(int l = 0; l < lanes; l++) r[l] = a[l] * a[l];
+                    break;
+                case Expr::Op::SIN:
+                    for(int l = 0; l < lanes; l++) r[l] = sin(a[l]);
+                    break;
+                case Expr::Op::COS:
+                    for(int l = 0; l < lanes; l++) r[l] = cos(a[l]);
+                    break;
+                case Expr::Op::ACOS:
+                    for(int l = 0; l < lanes; l++) r[l] = acos(a[l]);
+                    break;
+                case Expr::Op::ASIN:
+                    for(int l = 0; l < lanes; l++) r[l] = asin(a[l]);
+                    break;
+
+                default: ssassert(false, "Unexpected operation");
+            }
+        }
+        const double *result = x + s.result * lanes;
+        for(int l = 0; l < lanes; l++) {
+            out[output[s.first + l]] = result[l];
         }
-    } else ssassert(false, "Unexpected children count");
+
+        if(partials == NULL) continue;
+
+        double *d = &adjoint[s.value];
+        std::fill(d, d + s.rows * lanes, 0.0);
+        std::fill(d + s.result * lanes, d + (s.result + 1) * lanes, 1.0);
+        for(int c = s.end - 1; c >= s.start; c--) {
+            const ExprTape::Instruction &i = code[c];
+            const double *g = d + i.dest * lanes;
+            const double *r = x + i.dest * lanes;
+            const double *a = x + i.a * lanes, *b = x + i.b * lanes;
+            double *da = d + i.a * lanes, *db = d + i.b * lanes;
+            switch(i.op) {
+                case Expr::Op::PARAM_PTR: {
+                    const int *w = &partial[s.param + i.a * lanes];
+                    for(int l = 0; l < lanes; l++) {
+                        if(w[l] >= 0) partials[w[l]] = (g[l] != 0.0) ? g[l] : 0.0;
+                    }
+                    break;
+                }
+
+                case Expr::Op::PLUS:
+                    for(int l = 0; l < lanes; l++) {
+                        da[l] = (g[l] != 0.0) ? da[l] + g[l] : da[l];
+                        db[l] = (g[l] != 0.0) ? db[l] + g[l] : db[l];
+                    }
+                    break;
+                case Expr::Op::MINUS:
+                    for(int l = 0; l < lanes; l++) {
+                        da[l] = (g[l] != 0.0) ? da[l] + g[l] : da[l];
+                        db[l] = (g[l] != 0.0) ? db[l] - g[l] : db[l];
+                    }
+                    break;
+                case Expr::Op::TIMES:
+                    for(int l = 0; l < lanes; l++) {
+                        da[l] = (g[l] != 0.0) ? da[l] + g[l]*b[l] : da[l];
+                        db[l] = (g[l] != 0.0) ? db[l] + g[l]*a[l] : db[l];
+                    }
+                    break;
+                case Expr::Op::DIV:
+                    for(int l = 0; l < lanes; l++) {
+                        da[l] = (g[l] != 0.0) ? da[l] + g[l]/b[l] : da[l];
+                        db[l] = (g[l] != 0.0) ? db[l] - g[l]*a[l]/(b[l]*b[l]) : db[l];
+                    }
+                    break;
+
+                case Expr::Op::NEGATE:
+                    for(int l = 0; l < lanes; l++) {
+                        da[l] = (g[l] != 0.0) ? da[l] - g[l] : da[l];
+                    }
+                    break;
+                case Expr::Op::SQRT:
+                    for(int l = 0; l < lanes; l++) {
+                        da[l] = (g[l] != 0.0) ? da[l] + g[l]*0.5/r[l] : da[l];
+                    }
+                    break;
+                case Expr::Op::SQUARE:
+                    for(int l = 0; l < lanes; l++) {
+                        da[l] = (g[l] != 0.0) ? da[l] + g[l]*2.0*a[l] : da[l];
+                    }
+                    break;
+                case Expr::Op::SIN:
+                    for(int l = 0; l < lanes; l++) {
+                        if(g[l] != 0.0) da[l] += g[l]*cos(a[l]);
+                    }
+                    break;
+                case Expr::Op::COS:
+                    for(int l = 0; l < lanes; l++) {
+                        if(g[l] != 0.0) da[l] -= g[l]*sin(a[l]);
+                    }
+                    break;
+                case Expr::Op::ASIN:
+                    for(int l = 0; l < lanes; l++) {
+                        if(g[l] != 0.0) da[l] += g[l]/sqrt(1 - a[l]*a[l]);
+                    }
+                    break;
+                case Expr::Op::ACOS:
+                    for(int l = 0; l < lanes; l++) {
+                        if(g[l] != 0.0) da[l] -= g[l]/sqrt(1 - a[l]*a[l]);
+                    }
+                    break;
+
+                default: ssassert(false, "Unexpected operation");
+            }
+        }
+    }
 }
 
+//-----------------------------------------------------------------------------
+// Take the params from the tape again, after it's been rebound.
+//-----------------------------------------------------------------------------
+void ExprBatch::Rebind(const ExprTape &tape) {
+    for(size_t j = 0; j < param.size(); j++) {
+        param[j] = tape.code[paramCode[j]].p;
+    }
+}
 
 //-----------------------------------------------------------------------------
 // Routines to pretty-print an expression. Mostly for debugging.
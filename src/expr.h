@@ -70,14 +70,9 @@ public:
 
     Expr *PartialWrt(hParam p) const;
     double Eval() const;
-    uint64_t ParamsUsed() const;
-    bool DependsOn(hParam p) const;
+    void ParamsUsedList(std::vector<hParam> *list) const;
     static bool Tol(double a, double b);
     Expr *FoldConstants();
-    void Substitute(hParam oldh, hParam newh);
-
-    static const hParam NO_PARAMS, MULTIPLE_PARAMS;
-    hParam ReferencedParams(ParamList *pl) const;
 
     void ParamsToPointers();
 
@@ -137,4 +132,111 @@ public:
 
     Expr *Magnitude() const;
 };
+
+// A list of expressions, compiled to straight-line code that evaluates them
+// all in one loop, instead of recursing through each tree in Expr::Eval().
+// Identical subexpressions, within one expression or across several, are
+// compiled only once, so they're evaluated only once too. An ExprBatch
+// built from the tape also gives us the partials.
+// Params are read through pointers, so the param tables mustn't move while
+// the tape is in use.
+class ExprTape {
+public:
+    struct Instruction {
+        Expr::Op    op;
+        // The result goes in value[dest], from operands value[a] and
+        // value[b], or from the param p, with handle h. For a param, a is
+        // instead left to the caller, e.g. to say which partial with
+        // respect to it is wanted, or -1 if none.
+        int         dest, a, b;
+        Param       *p;
+        hParam      h;
+    };
+
+    // Constants have a value, but no instruction to compute it.
+    std::vector<Instruction>    code;
+    std::vector<double>         value;
+
+    // Each expression that was added, in order: its value, and the
+    // instructions that it needs, in order, as needs[start] to needs[end-1].
+    struct Output {
+        int         value;
+        int         start, end;
+    };
+    std::vector<Output>         output;
+    std::vector<int>            needs;
+
+    void Clear();
+    int Add(const Expr *e);
+    void Eval(double *out);
+    void Rebind(IdList<Param,hParam> *firstTry, IdList<Param,hParam> *thenTry);
+
+private:
+    // To find an instruction or constant that we've compiled already
+    struct Key {
+        Expr::Op    op;
+        int         a, b;
+        Param       *p;
+        uint64_t    v;
+
+        bool operator==(const Key &k) const {
+            return op == k.op && a == k.a && b == k.b && p == k.p && v == k.v;
+        }
+    };
+    struct KeyHash {
+        size_t operator()(const Key &k) const;
+    };
+    std::unordered_map<Key, int, KeyHash>   compiled;
+    // For each value, the instruction that computes it, or -1
+    std::vector<int>                        valueCode;
+    std::vector<int>                        visited;
+
+    int Compile(const Expr *e);
+};
+
+// The expressions of a tape, grouped by shape, to evaluate and differentiate
+// many of them at once. Two expressions have the same shape if they need the
+// same instructions in the same order, and differ only in which params and
+// constants they read; so there's one group for e.g. all the point-point
+// distances in a sketch. The values of a group are stored by instruction,
+// and then by expression, so that each instruction is done for the whole
+// group in one loop, which the compiler can vectorize. Subexpressions that
+// several expressions share are computed for each of them, but the results
+// are identical to the tape's.
+class ExprBatch {
+public:
+    // The instructions of each shape, as in the tape but with dest, a and b
+    // as rows of the shape's values, and a param's a as its column of the
+    // shape's params.
+    std::vector<ExprTape::Instruction>  code;
+
+    // The expressions of each shape: their output index in the tape, and
+    // row by row, a value for each; then for each param that they read,
+    // a pointer to it, the tape instruction that reads it, and where its
+    // partial goes, or -1.
+    std::vector<int>                    output;
+    std::vector<double>                 value;
+    std::vector<double>                 adjoint;
+    std::vector<Param *>                param;
+    std::vector<int>                    paramCode;
+    std::vector<int>                    partial;
+
+    // Each shape, as ranges of the lists above: its instructions are
+    // code[start] to code[end-1], its expressions output[first] on, row r of
+    // its values value[value + r*lanes] on, and its column j of params
+    // param[param + j*lanes] on.
+    struct Shape {
+        int     start, end;
+        int     rows, params, result;
+        int     lanes;
+        int     first, value, param;
+    };
+    std::vector<Shape>                  shape;
+
+    void Clear();
+    void Build(const ExprTape &tape,
+               std::function<int(int output, const ExprTape::Instruction &i)> partialIndex);
+    void Eval(double *out, double *partials = NULL);
+    void Rebind(const ExprTape &tape);
+};
 #endif
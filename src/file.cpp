@@ -114,6 +114,7 @@ const SolveSpaceUI::SaveTable SolveSpaceUI::SAVED[] = {
     { 'g',  "Group.suppress",           'b',    &(SS.sv.g.suppress)           },
     { 'g',  "Group.relaxConstraints",   'b',    &(SS.sv.g.relaxConstraints)   },
     { 'g',  "Group.allowRedundant",     'b',    &(SS.sv.g.allowRedundant)     },
+    { 'g',  "Group.dampedSolve",        'b',    &(SS.sv.g.dampedSolve)        },
     { 'g',  "Group.allDimsReference",   'b',    &(SS.sv.g.allDimsReference)   },
     { 'g',  "Group.scale",              'f',    &(SS.sv.g.scale)              },
     { 'g',  "Group.remap",              'M',    &(SS.sv.g.remap)              },
@@ -483,6 +484,11 @@ bool SolveSpaceUI::LoadFromFile(const Platform::Path &filename, bool canCancel)
     sv.g.scale = 1; // default is 1, not 0; so legacy files need this
     Style::FillDefaultStyle(&sv.s);
 
+    // Nothing is looked up until we've read the whole file.
+    SK.param.BeginBulkAdd();
+    SK.request.BeginBulkAdd();
+    SK.constraint.BeginBulkAdd();
+
     char line[1024];
     while(fgets(line, (int)sizeof(line), fh)) {
         char *s = strchr(line, '\n');
@@ -545,6 +551,10 @@ bool SolveSpaceUI::LoadFromFile(const Platform::Path &filename, bool canCancel)
 
     fclose(fh);
 
+    SK.param.EndBulkAdd();
+    SK.request.EndBulkAdd();
+    SK.constraint.EndBulkAdd();
+
     if(fileLoadError) {
         Error(_("Unrecognized data in file. This file may be corrupt, or "
                 "from a newer version of the program."));
@@ -710,6 +720,7 @@ bool SolveSpaceUI::LoadEntitiesFromFile(const Platform::Path &filename, EntityLi
     if(!fh) return false;
 
     le->Clear();
+    le->BeginBulkAdd();
     sv = {};
 
     char line[1024];
@@ -837,6 +848,7 @@ bool SolveSpaceUI::LoadEntitiesFromFile(const Platform::Path &filename, EntityLi
     }
 
     fclose(fh);
+    le->EndBulkAdd();
     return true;
 }
 
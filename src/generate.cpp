@@ -30,24 +30,16 @@ void SolveSpaceUI::MarkGroupDirty(hGroup hg, bool onlyThis) {
 }
 
 bool SolveSpaceUI::PruneOrphans() {
-
-    auto r = std::find_if(SK.request.begin(), SK.request.end(),
-                          [&](Request &r) { return !GroupExists(r.group); });
-    if(r != SK.request.end()) {
-        (deleted.requests)++;
-        SK.request.RemoveById(r->h);
-        return true;
-    }
-
-    auto c = std::find_if(SK.constraint.begin(), SK.constraint.end(),
-                          [&](Constraint &c) { return !GroupExists(c.group); });
-    if(c != SK.constraint.end()) {
-        (deleted.constraints)++;
-        (deleted.nonTrivialConstraints)++;
-        SK.constraint.RemoveById(c->h);
-        return true;
-    }
-    return false;
+    int requests = SK.request.RemoveIf([&](Request &r) {
+        return !GroupExists(r.group);
+    });
+    int constraints = SK.constraint.RemoveIf([&](Constraint &c) {
+        return !GroupExists(c.group);
+    });
+    deleted.requests += requests;
+    deleted.constraints += constraints;
+    deleted.nonTrivialConstraints += constraints;
+    return requests > 0 || constraints > 0;
 }
 
 bool SolveSpaceUI::GroupsInOrder(hGroup before, hGroup after) {
@@ -86,19 +78,40 @@ bool SolveSpaceUI::PruneGroups(hGroup hg) {
     return true;
 }
 
+//-----------------------------------------------------------------------------
+// Remove the requests and constraints in the group that we just generated
+// that refer to something that doesn't exist, all at once; along with what
+// they generated, so that we can carry on without generating again.
+//-----------------------------------------------------------------------------
 bool SolveSpaceUI::PruneRequests(hGroup hg) {
-    auto e = std::find_if(SK.entity.begin(), SK.entity.end(),
-                          [&](Entity &e) { return e.group == hg && !EntityExists(e.workplane); });
-    if(e != SK.entity.end()) {
-        (deleted.requests)++;
-        SK.entity.RemoveById(e->h);
-        return true;
+    std::vector<hRequest> pruned;
+    for(Entity &e : SK.entity) {
+        if(e.group != hg || EntityExists(e.workplane) || !e.h.isFromRequest()) continue;
+        if(pruned.empty() || pruned.back() != e.h.request()) {
+            pruned.push_back(e.h.request());
+        }
     }
-    return false;
+    if(pruned.empty()) return false;
+
+    // The entities are in order of handle, so these are too.
+    auto isPruned = [&](hRequest hr) {
+        return std::binary_search(pruned.begin(), pruned.end(), hr);
+    };
+    deleted.requests += SK.request.RemoveIf([&](Request &r) {
+        return isPruned(r.h);
+    });
+    SK.entity.RemoveIf([&](Entity &e) {
+        return e.h.isFromRequest() && isPruned(e.h.request());
+    });
+    SK.param.RemoveIf([&](Param &p) {
+        return p.h.isFromRequest() && isPruned(p.h.request());
+    });
+    return true;
 }
 
 bool SolveSpaceUI::PruneConstraints(hGroup hg) {
-    auto c = std::find_if(SK.constraint.begin(), SK.constraint.end(), [&](Constraint &c) {
+    std::vector<hParam> params;
+    int removed = SK.constraint.RemoveIf([&](Constraint &c) {
         if(c.group != hg)
             return false;
 
@@ -111,21 +124,23 @@ bool SolveSpaceUI::PruneConstraints(hGroup hg) {
            EntityExists(c.entityD)) {
             return false;
         }
-        return true;
-    });
 
-    if(c != SK.constraint.end()) {
         (deleted.constraints)++;
-        if(c->type != Constraint::Type::POINTS_COINCIDENT &&
-           c->type != Constraint::Type::HORIZONTAL &&
-           c->type != Constraint::Type::VERTICAL) {
+        if(c.type != Constraint::Type::POINTS_COINCIDENT &&
+           c.type != Constraint::Type::HORIZONTAL &&
+           c.type != Constraint::Type::VERTICAL) {
             (deleted.nonTrivialConstraints)++;
         }
-
-        SK.constraint.RemoveById(c->h);
+        if(c.valP.v) params.push_back(c.valP);
         return true;
-    }
-    return false;
+    });
+    if(removed == 0) return false;
+
+    std::sort(params.begin(), params.end());
+    SK.param.RemoveIf([&](Param &p) {
+        return std::binary_search(params.begin(), params.end(), p.h);
+    });
+    return true;
 }
 
 void SolveSpaceUI::GenerateAll(Generate type, bool andFindFree, bool genForBBox) {
@@ -203,8 +218,7 @@ void SolveSpaceUI::GenerateAll(Generate type, bool andFindFree, bool genForBBox)
     // Remove any requests or constraints that refer to a nonexistent
     // group; can check those immediately, since we know what the list
     // of groups should be.
-    while(PruneOrphans())
-        ;
+    PruneOrphans();
 
     // Don't lose our numerical guesses when we regenerate.
     IdList<Param,hParam> prev = {};
@@ -224,24 +238,28 @@ void SolveSpaceUI::GenerateAll(Generate type, bool andFindFree, bool genForBBox)
         if(PruneGroups(hg))
             goto pruned;
 
-        for(auto &req : SK.request) {
-            Request *r = &req;
-            if(r->group != hg) continue;
-
-            r->Generate(&(SK.entity), &(SK.param));
+        // The requests and constraints don't look anything up as they
+        // generate, so we can add their entities and params in bulk.
+        const Sketch::GroupItems &items = SK.ItemsInGroup(hg);
+        SK.entity.BeginBulkAdd();
+        SK.param.BeginBulkAdd();
+        for(int i : items.request) {
+            SK.request[i].Generate(&(SK.entity), &(SK.param));
         }
-        for(auto &con : SK.constraint) {
-            Constraint *c = &con;
-            if(c->group != hg) continue;
-
-            c->Generate(&(SK.param));
+        for(int i : items.constraint) {
+            SK.constraint[i].Generate(&(SK.param));
         }
+        SK.entity.EndBulkAdd();
+        SK.param.EndBulkAdd();
         SK.GetGroup(hg)->Generate(&(SK.entity), &(SK.param));
 
         // The requests and constraints depend on stuff in this or the
-        // previous group, so check them after generating.
-        if(PruneRequests(hg) || PruneConstraints(hg))
-            goto pruned;
+        // previous group, so check them after generating. A request can
+        // lie in a workplane from another request that we prune, and so can
+        // a constraint, so keep on until there's nothing left to prune.
+        while(PruneRequests(hg))
+            ;
+        PruneConstraints(hg);
 
         // Use the previous values for params that we've seen before, as
         // initial guesses for the solver.
@@ -344,12 +362,15 @@ void SolveSpaceUI::GenerateAll(Generate type, bool andFindFree, bool genForBBox)
                        deleted.requests, deleted.requests == 1 ? "" : "s",
                        deleted.constraints, deleted.constraints == 1 ? "" : "s",
                        deleted.groups, deleted.groups == 1 ? "" : "s",
-                       undo.cnt > 0 ? "\n\nChoose Edit -> Undo to undelete all elements." : "");
+                       !undo.empty() ? "\n\nChoose Edit -> Undo to undelete all elements." : "");
         }
 
         deleted = {};
     }
 
+    // Keep the solver's structure only for the groups that we just solved.
+    sys.ForgetUnusedStructures();
+
     FreeAllTemporary();
     allConsistent = true;
     SS.GW.persistentDirty = true;
@@ -504,17 +525,12 @@ void SolveSpaceUI::WriteEqSystemForGroup(hGroup hg) {
     sys.param.Clear();
     sys.eq.Clear();
     // And generate all the params for requests in this group
-    for(auto &req : SK.request) {
-        Request *r = &req;
-        if(r->group != hg) continue;
-
-        r->Generate(&(sys.entity), &(sys.param));
+    const Sketch::GroupItems &items = SK.ItemsInGroup(hg);
+    for(int i : items.request) {
+        SK.request[i].Generate(&(sys.entity), &(sys.param));
     }
-    for(auto &con : SK.constraint) {
-        Constraint *c = &con;
-        if(c->group != hg) continue;
-
-        c->Generate(&(sys.param));
+    for(int i : items.constraint) {
+        SK.constraint[i].Generate(&(sys.param));
     }
     // And for the group itself
     Group *g = SK.GetGroup(hg);
@@ -543,6 +559,7 @@ void SolveSpaceUI::SolveGroup(hGroup hg, bool andFindFree) {
         g->dofCheckOk = true;
     }
     g->solved.how = how;
+    g->solved.stats = sys.stats;
     FreeAllTemporary();
 }
 
@@ -50,8 +50,7 @@ bool Group::IsVisible() {
 }
 
 size_t Group::GetNumConstraints() {
-    return std::count_if(SK.constraint.begin(), SK.constraint.end(),
-                         [&](Constraint const &c) { return c.group == h; });
+    return SK.ItemsInGroup(h).constraint.size();
 }
 
 Vector Group::ExtrusionGetVector() {
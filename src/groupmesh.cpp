@@ -226,6 +226,22 @@ void Group::GenerateShellAndMesh() {
             tbot = translate.ScaledBy(-1); ttop = translate.ScaledBy(1);
         }
 
+        // The line segments that the sides might have been extruded from,
+        // found once here rather than by searching every entity per side.
+        struct SideEdge {
+            hEntity h;
+            Vector  a, b;
+        };
+        std::vector<SideEdge> edges;
+        for(Entity &e : SK.entity) {
+            if(e.group != opA) continue;
+            if(e.type != Entity::Type::LINE_SEGMENT) continue;
+
+            edges.push_back({ e.h,
+                SK.GetEntity(e.point[0])->PointGetNum().Plus(ttop),
+                SK.GetEntity(e.point[1])->PointGetNum().Plus(ttop) });
+        }
+
         SBezierLoopSetSet *sblss = &(src->bezierLoops);
         SBezierLoopSet *sbls;
         for(sbls = sblss->l.First(); sbls; sbls = sblss->l.NextAfter(sbls)) {
@@ -263,22 +279,15 @@ void Group::GenerateShellAndMesh() {
                 // So these are the sides
                 if(ss->degm != 1 || ss->degn != 1) continue;
 
-                Entity *e;
-                for(e = SK.entity.First(); e; e = SK.entity.NextAfter(e)) {
-                    if(e->group != opA) continue;
-                    if(e->type != Entity::Type::LINE_SEGMENT) continue;
-
-                    Vector a = SK.GetEntity(e->point[0])->PointGetNum(),
-                           b = SK.GetEntity(e->point[1])->PointGetNum();
-                    a = a.Plus(ttop);
-                    b = b.Plus(ttop);
+                for(const SideEdge &e : edges) {
+                    const Vector &a = e.a, &b = e.b;
                     // Could get taken backwards, so check all cases.
                     if((a.Equals(ss->ctrl[0][0]) && b.Equals(ss->ctrl[1][0])) ||
                        (b.Equals(ss->ctrl[0][0]) && a.Equals(ss->ctrl[1][0])) ||
                        (a.Equals(ss->ctrl[0][1]) && b.Equals(ss->ctrl[1][1])) ||
                        (b.Equals(ss->ctrl[0][1]) && a.Equals(ss->ctrl[1][1])))
                     {
-                        face = Remap(e->h, REMAP_LINE_TO_FACE);
+                        face = Remap(e.h, REMAP_LINE_TO_FACE);
                         ss->face = face.v;
                         break;
                     }
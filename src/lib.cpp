@@ -7,11 +7,33 @@
 #include "solvespace.h"
 #define EXPORT_DLL
 #include <slvs.h>
+#include <mutex>
 
-Sketch SolveSpace::SK = {};
-static System SYS;
+thread_local Sketch *SolveSpace::CurrentSketch = NULL;
 
-static int IsInit = 0;
+// Everything that a solve works on, except for the temporary memory, which
+// belongs to the thread.
+struct Slvs_Context {
+    Sketch  sk;
+    System  sys;
+
+    // The group of each param in the sketch, since Param doesn't keep that
+    std::unordered_map<uint32_t, Slvs_hGroup>   paramGroup;
+    // The group whose params are in sys.param, or 0 if they need rewriting
+    Slvs_hGroup                                 paramsFor;
+    // Set by Slvs_SetDamped(), and kept across loads
+    bool                                        damped;
+};
+
+// The context that Slvs_Solve() uses, for compatibility
+static Slvs_Context DefaultContext;
+
+static std::once_flag InitOnce;
+
+// The scenarios of a batch are solved in runs of this many, each one
+// started from the solution of the one before; so the solutions don't
+// depend on how many threads there are.
+static const int BATCH_RUN = 16;
 
 void SolveSpace::Platform::FatalError(const std::string &message) {
     fprintf(stderr, "%s", message.c_str());
@@ -67,31 +89,24 @@ void Slvs_MakeQuaternion(double ux, double uy, double uz,
     *qz = q.vz;
 }
 
-void Slvs_Solve(Slvs_System *ssys, Slvs_hGroup shg)
-{
-    if(!IsInit) {
-        InitPlatform(0, NULL);
-        IsInit = 1;
-    }
-
-    int i;
-    for(i = 0; i < ssys->params; i++) {
-        Slvs_Param *sp = &(ssys->param[i]);
-        Param p = {};
+} /* extern "C" */
 
-        p.h.v = sp->h;
-        p.val = sp->val;
-        SK.param.Add(&p);
-        if(sp->group == shg) {
-            SYS.param.Add(&p);
-        }
-    }
+//-----------------------------------------------------------------------------
+// Load a system into the current context, a piece at a time.
+//-----------------------------------------------------------------------------
+static void LoadParam(Slvs_Context *ctx, const Slvs_Param *sp) {
+    Param p = {};
+    p.h.v = sp->h;
+    p.val = sp->val;
+    SK.param.Add(&p);
+    ctx->paramGroup[sp->h] = sp->group;
+    ctx->paramsFor = 0;
+}
 
-    for(i = 0; i < ssys->entities; i++) {
-        Slvs_Entity *se = &(ssys->entity[i]);
-        EntityBase e = {};
+static bool LoadEntity(const Slvs_Entity *se) {
+    EntityBase e = {};
 
-        switch(se->type) {
+    switch(se->type) {
 case SLVS_E_POINT_IN_3D:        e.type = Entity::Type::POINT_IN_3D; break;
 case SLVS_E_POINT_IN_2D:        e.type = Entity::Type::POINT_IN_2D; break;
 case SLVS_E_NORMAL_IN_3D:       e.type = Entity::Type::NORMAL_IN_3D; break;
@@ -103,31 +118,48 @@ case SLVS_E_CUBIC:              e.type = Entity::Type::CUBIC; break;
 case SLVS_E_CIRCLE:             e.type = Entity::Type::CIRCLE; break;
 case SLVS_E_ARC_OF_CIRCLE:      e.type = Entity::Type::ARC_OF_CIRCLE; break;
 
-default: dbp("bad entity type %d", se->type); return;
-        }
-        e.h.v           = se->h;
-        e.group.v       = se->group;
-        e.workplane.v   = se->wrkpl;
-        e.point[0].v    = se->point[0];
-        e.point[1].v    = se->point[1];
-        e.point[2].v    = se->point[2];
-        e.point[3].v    = se->point[3];
-        e.normal.v      = se->normal;
-        e.distance.v    = se->distance;
-        e.param[0].v    = se->param[0];
-        e.param[1].v    = se->param[1];
-        e.param[2].v    = se->param[2];
-        e.param[3].v    = se->param[3];
-
-        SK.entity.Add(&e);
+default: dbp("bad entity type %d", se->type); return false;
     }
-    IdList<Param, hParam> params = {};
-    for(i = 0; i < ssys->constraints; i++) {
-        Slvs_Constraint *sc = &(ssys->constraint[i]);
-        ConstraintBase c = {};
+    e.h.v           = se->h;
+    e.group.v       = se->group;
+    e.workplane.v   = se->wrkpl;
+    e.point[0].v    = se->point[0];
+    e.point[1].v    = se->point[1];
+    e.point[2].v    = se->point[2];
+    e.point[3].v    = se->point[3];
+    e.normal.v      = se->normal;
+    e.distance.v    = se->distance;
+    e.param[0].v    = se->param[0];
+    e.param[1].v    = se->param[1];
+    e.param[2].v    = se->param[2];
+    e.param[3].v    = se->param[3];
+
+    SK.entity.Add(&e);
+    return true;
+}
+
+// Whether a handle names an entity or param that's loaded; zero is no
+// handle, which is always fine.
+static bool EntityExists(hEntity he) {
+    return he.v == 0 || SK.entity.FindByIdNoOops(he) != NULL;
+}
+static bool ParamExists(hParam hp) {
+    return hp.v == 0 || SK.param.FindByIdNoOops(hp) != NULL;
+}
 
-        Constraint::Type t;
-        switch(sc->type) {
+static bool EntityRefsExist(const EntityBase &e) {
+    for(int i = 0; i < 4; i++) {
+        if(!EntityExists(e.point[i]) || !ParamExists(e.param[i])) return false;
+    }
+    return EntityExists(e.workplane) && EntityExists(e.normal) &&
+           EntityExists(e.distance);
+}
+
+static bool LoadConstraint(Slvs_Context *ctx, const Slvs_Constraint *sc) {
+    ConstraintBase c = {};
+
+    Constraint::Type t;
+    switch(sc->type) {
 case SLVS_C_POINTS_COINCIDENT:  t = Constraint::Type::POINTS_COINCIDENT; break;
 case SLVS_C_PT_PT_DISTANCE:     t = Constraint::Type::PT_PT_DISTANCE; break;
 case SLVS_C_PT_PLANE_DISTANCE:  t = Constraint::Type::PT_PLANE_DISTANCE; break;
@@ -163,53 +195,138 @@ case SLVS_C_PROJ_PT_DISTANCE:   t = Constraint::Type::PROJ_PT_DISTANCE; break;
 case SLVS_C_WHERE_DRAGGED:      t = Constraint::Type::WHERE_DRAGGED; break;
 case SLVS_C_CURVE_CURVE_TANGENT:t = Constraint::Type::CURVE_CURVE_TANGENT; break;
 
-default: dbp("bad constraint type %d", sc->type); return;
+default: dbp("bad constraint type %d", sc->type); return false;
+    }
+
+    c.type = t;
+
+    c.h.v           = sc->h;
+    c.group.v       = sc->group;
+    c.workplane.v   = sc->wrkpl;
+    c.valA          = sc->valA;
+    c.ptA.v         = sc->ptA;
+    c.ptB.v         = sc->ptB;
+    c.entityA.v     = sc->entityA;
+    c.entityB.v     = sc->entityB;
+    c.entityC.v     = sc->entityC;
+    c.entityD.v     = sc->entityD;
+    c.other         = (sc->other) ? true : false;
+    c.other2        = (sc->other2) ? true : false;
+
+    if(!EntityExists(c.workplane) || !EntityExists(c.ptA) || !EntityExists(c.ptB) ||
+       !EntityExists(c.entityA) || !EntityExists(c.entityB) ||
+       !EntityExists(c.entityC) || !EntityExists(c.entityD))
+    {
+        dbp("constraint %08x refers to a missing entity", sc->h);
+        return false;
+    }
+
+    IdList<Param, hParam> params = {};
+    c.Generate(&params);
+    if(!params.IsEmpty()) {
+        for(Param &p : params) {
+            p.h = SK.param.AddAndAssignId(&p);
+            c.valP = p.h;
+            ctx->paramGroup[p.h.v] = c.group.v;
         }
+        params.Clear();
+        ctx->paramsFor = 0;
+        c.ModifyToSatisfy();
+    }
+
+    SK.constraint.Add(&c);
+    return true;
+}
+
+static bool Load(Slvs_Context *ctx, const Slvs_System *ssys) {
+    // The params and entities may come in any order, so add them in bulk
+    // and sort them once; the constraints need to look them up.
+    int i;
+    SK.param.BeginBulkAdd();
+    for(i = 0; i < ssys->params; i++) {
+        LoadParam(ctx, &(ssys->param[i]));
+    }
+    SK.param.EndBulkAdd();
+
+    bool ok = true;
+    SK.entity.BeginBulkAdd();
+    for(i = 0; ok && i < ssys->entities; i++) {
+        ok = LoadEntity(&(ssys->entity[i]));
+    }
+    SK.entity.EndBulkAdd();
+    for(i = 0; ok && i < SK.entity.n; i++) {
+        ok = EntityRefsExist(SK.entity[i]);
+        if(!ok) dbp("entity %08x refers to a missing handle", SK.entity[i].h.v);
+    }
+
+    SK.constraint.BeginBulkAdd();
+    for(i = 0; ok && i < ssys->constraints; i++) {
+        ok = LoadConstraint(ctx, &(ssys->constraint[i]));
+    }
+    SK.constraint.EndBulkAdd();
+    return ok;
+}
+
+static void Unload(Slvs_Context *ctx) {
+    ctx->sys.param.Clear();
+    ctx->sys.entity.Clear();
+    ctx->sys.eq.Clear();
+    ctx->sys.dragged.Clear();
+
+    SK.param.Clear();
+    SK.entity.Clear();
+    SK.constraint.Clear();
+    ctx->paramGroup.clear();
+    ctx->paramsFor = 0;
+}
+
+static void Use(Slvs_Context *ctx) {
+    std::call_once(InitOnce, [] { InitPlatform(0, NULL); });
+    CurrentSketch = &(ctx->sk);
+}
+
+//-----------------------------------------------------------------------------
+// Solve the system that's loaded into the current context.
+//-----------------------------------------------------------------------------
+static void SolveLoaded(Slvs_Context *ctx, Slvs_System *ssys, Slvs_hGroup shg) {
+    System *sys = &(ctx->sys);
+    int i;
 
-        c.type = t;
-
-        c.h.v           = sc->h;
-        c.group.v       = sc->group;
-        c.workplane.v   = sc->wrkpl;
-        c.valA          = sc->valA;
-        c.ptA.v         = sc->ptA;
-        c.ptB.v         = sc->ptB;
-        c.entityA.v     = sc->entityA;
-        c.entityB.v     = sc->entityB;
-        c.entityC.v     = sc->entityC;
-        c.entityD.v     = sc->entityD;
-        c.other         = (sc->other) ? true : false;
-        c.other2        = (sc->other2) ? true : false;
-
-        c.Generate(&params);
-        if(!params.IsEmpty()) {
-            for(Param &p : params) {
-                p.h = SK.param.AddAndAssignId(&p);
-                c.valP = p.h;
-                SYS.param.Add(&p);
+    // The params that we're solving for, with their current values; they
+    // all start out unknown, and so does every other param in the sketch.
+    if(ctx->paramsFor != shg) {
+        sys->param.Clear();
+        for(Param &p : SK.param) {
+            if(ctx->paramGroup[p.h.v] == shg) {
+                sys->param.Add(&p);
             }
-            params.Clear();
-            c.ModifyToSatisfy();
         }
-
-        SK.constraint.Add(&c);
+        ctx->paramsFor = shg;
+    }
+    for(Param &p : sys->param) {
+        Param *pp = SK.GetParam(p.h);
+        p.val   = pp->val;
+        p.known = false;
     }
 
     for(i = 0; i < (int)arraylen(ssys->dragged); i++) {
         if(ssys->dragged[i]) {
             hParam hp = { ssys->dragged[i] };
-            SYS.dragged.Add(&hp);
+            sys->dragged.Add(&hp);
         }
     }
 
     Group g = {};
     g.h.v = shg;
+    g.dampedSolve = ctx->damped;
 
     List<hConstraint> bad = {};
 
     // Now we're finally ready to solve!
     bool andFindBad = ssys->calculateFaileds ? true : false;
-    SolveResult how = SYS.Solve(&g, NULL, &(ssys->dof), &bad, andFindBad, /*andFindFree=*/false);
+    SolveResult how = sys->Solve(&g, NULL, &(ssys->dof), &bad, andFindBad, /*andFindFree=*/false);
+    // Keep the structure only for the group that we solved last.
+    sys->ForgetUnusedStructures();
 
     switch(how) {
         case SolveResult::OKAY:
@@ -224,10 +341,6 @@ default: dbp("bad constraint type %d", sc->type); return;
         case SolveResult::REDUNDANT_OKAY:
             ssys->result = SLVS_RESULT_INCONSISTENT;
             break;
-
-        case SolveResult::TOO_MANY_UNKNOWNS:
-            ssys->result = SLVS_RESULT_TOO_MANY_UNKNOWNS;
-            break;
     }
 
     // Write the new parameter values back to our caller.
@@ -236,6 +349,9 @@ default: dbp("bad constraint type %d", sc->type); return;
         hParam hp = { sp->h };
         sp->val = SK.GetParam(hp)->val;
     }
+    for(Param &p : sys->param) {
+        SK.GetParam(p.h)->known = false;
+    }
 
     if(ssys->failed) {
         // Copy over any the list of problematic constraints.
@@ -246,16 +362,267 @@ default: dbp("bad constraint type %d", sc->type); return;
     }
 
     bad.Clear();
-    SYS.param.Clear();
-    SYS.entity.Clear();
-    SYS.eq.Clear();
-    SYS.dragged.Clear();
-
-    SK.param.Clear();
-    SK.entity.Clear();
-    SK.constraint.Clear();
+    sys->eq.Clear();
+    sys->dragged.Clear();
 
     FreeAllTemporary();
 }
 
+//-----------------------------------------------------------------------------
+// Solve runs of scenarios from a batch, until there are none left.
+//-----------------------------------------------------------------------------
+static void SolveBatchRuns(const Slvs_System *ssys, Slvs_hGroup shg, Slvs_Batch *batch,
+                           std::atomic<int> *next)
+{
+    Slvs_Context *ctx = new Slvs_Context();
+    ctx->damped = batch->damped ? true : false;
+    // The scenarios are already shared out among as many threads as there
+    // are cores, so each of those solves its systems by itself.
+    ctx->sys.threads = 1;
+    Use(ctx);
+    int i, j;
+    bool ok = Load(ctx, ssys);
+    for(j = 0; ok && j < batch->constraints; j++) {
+        hConstraint hc = { batch->constraint[j] };
+        ok = (SK.constraint.FindByIdNoOops(hc) != NULL);
+    }
+    for(j = 0; ok && j < batch->params; j++) {
+        hParam hp = { batch->param[j] };
+        ok = (SK.param.FindByIdNoOops(hp) != NULL);
+    }
+    if(!ok) {
+        // Nothing can be solved, but every scenario still gets its result.
+        int first;
+        while((first = next->fetch_add(BATCH_RUN)) < batch->scenarios) {
+            int last = std::min(first + BATCH_RUN, batch->scenarios);
+            for(i = first; i < last; i++) {
+                for(j = 0; j < ssys->params; j++) {
+                    batch->solution[i*ssys->params + j] = ssys->param[j].val;
+                }
+                batch->result[i] = SLVS_RESULT_INVALID;
+            }
+        }
+        Unload(ctx);
+        delete ctx;
+        return;
+    }
+
+    // The constraints read their values from params that aren't solved
+    // for, so that they can change without changing the equations.
+    std::vector<hParam> valAParam;
+    for(j = 0; j < batch->constraints; j++) {
+        hConstraint hc = { batch->constraint[j] };
+        ConstraintBase *c = SK.GetConstraint(hc);
+        Param p = {};
+        p.val = c->valA;
+        c->valAParam = SK.param.AddAndAssignId(&p);
+        valAParam.push_back(c->valAParam);
+    }
+
+    // The params whose values we set and get; the sketch won't change
+    // from now on, so they stay put. (Adding the params above may have
+    // moved the others, so these must come after.)
+    std::vector<Param *> solution, param, constraintVal;
+    for(i = 0; i < ssys->params; i++) {
+        hParam hp = { ssys->param[i].h };
+        solution.push_back(SK.GetParam(hp));
+    }
+    for(j = 0; j < batch->params; j++) {
+        hParam hp = { batch->param[j] };
+        param.push_back(SK.GetParam(hp));
+    }
+    for(hParam hp : valAParam) {
+        constraintVal.push_back(SK.GetParam(hp));
+    }
+    std::vector<double> initial;
+    for(Param &p : SK.param) {
+        initial.push_back(p.val);
+    }
+
+    Slvs_System s = {};
+    memcpy(s.dragged, ssys->dragged, sizeof(s.dragged));
+
+    int first;
+    while((first = next->fetch_add(BATCH_RUN)) < batch->scenarios) {
+        int last = std::min(first + BATCH_RUN, batch->scenarios);
+        bool warm = false;
+        for(i = first; i < last; i++) {
+            if(!warm) {
+                for(j = 0; j < SK.param.n; j++) {
+                    SK.param[j].val = initial[j];
+                }
+            }
+            for(j = 0; j < batch->params; j++) {
+                param[j]->val = batch->paramVal[i*batch->params + j];
+            }
+            for(j = 0; j < batch->constraints; j++) {
+                constraintVal[j]->val = batch->constraintVal[i*batch->constraints + j];
+            }
+
+            SolveLoaded(ctx, &s, shg);
+
+            for(j = 0; j < ssys->params; j++) {
+                batch->solution[i*ssys->params + j] = solution[j]->val;
+            }
+            batch->result[i] = s.result;
+            // If this one didn't converge, then start the next one over.
+            warm = (s.result == SLVS_RESULT_OKAY);
+        }
+    }
+
+    Unload(ctx);
+    delete ctx;
+}
+
+extern "C" {
+
+Slvs_Context *Slvs_CreateContext(void)
+{
+    return new Slvs_Context();
+}
+
+void Slvs_DestroyContext(Slvs_Context *ctx)
+{
+    Use(ctx);
+    Unload(ctx);
+    delete ctx;
+}
+
+void Slvs_Solve(Slvs_System *ssys, Slvs_hGroup shg)
+{
+    Slvs_SolveInContext(&DefaultContext, ssys, shg);
+}
+
+void Slvs_SolveInContext(Slvs_Context *ctx, Slvs_System *ssys, Slvs_hGroup shg)
+{
+    Use(ctx);
+    Unload(ctx);
+    if(Load(ctx, ssys)) {
+        SolveLoaded(ctx, ssys, shg);
+    } else {
+        ssys->result = SLVS_RESULT_INVALID;
+        if(ssys->failed) ssys->faileds = 0;
+    }
+    Unload(ctx);
+}
+
+int Slvs_LoadSystem(Slvs_Context *ctx, const Slvs_System *ssys)
+{
+    Use(ctx);
+    Unload(ctx);
+    if(!Load(ctx, ssys)) {
+        Unload(ctx);
+        return SLVS_RESULT_INVALID;
+    }
+    return SLVS_RESULT_OKAY;
+}
+
+int Slvs_SetParam(Slvs_Context *ctx, Slvs_hParam h, double val)
+{
+    Use(ctx);
+    hParam hp = { h };
+    Param *p = SK.param.FindByIdNoOops(hp);
+    if(!p) return SLVS_RESULT_INVALID;
+    p->val = val;
+    return SLVS_RESULT_OKAY;
+}
+
+int Slvs_GetParam(Slvs_Context *ctx, Slvs_hParam h, double *val)
+{
+    Use(ctx);
+    hParam hp = { h };
+    Param *p = SK.param.FindByIdNoOops(hp);
+    if(!p) return SLVS_RESULT_INVALID;
+    *val = p->val;
+    return SLVS_RESULT_OKAY;
+}
+
+int Slvs_AddConstraint(Slvs_Context *ctx, const Slvs_Constraint *c)
+{
+    Use(ctx);
+    hConstraint hc = { c->h };
+    if(SK.constraint.FindByIdNoOops(hc) || !LoadConstraint(ctx, c)) {
+        return SLVS_RESULT_INVALID;
+    }
+    return SLVS_RESULT_OKAY;
+}
+
+int Slvs_RemoveConstraint(Slvs_Context *ctx, Slvs_hConstraint h)
+{
+    Use(ctx);
+    hConstraint hc = { h };
+    ConstraintBase *c = SK.constraint.FindByIdNoOops(hc);
+    if(!c) return SLVS_RESULT_INVALID;
+    if(c->valP.v) {
+        ctx->paramGroup.erase(c->valP.v);
+        ctx->paramsFor = 0;
+        SK.param.RemoveById(c->valP);
+    }
+    SK.constraint.RemoveById(hc);
+    return SLVS_RESULT_OKAY;
+}
+
+void Slvs_SolveLoaded(Slvs_Context *ctx, Slvs_System *ssys, Slvs_hGroup shg)
+{
+    Use(ctx);
+    for(int i = 0; i < ssys->params; i++) {
+        hParam hp = { ssys->param[i].h };
+        if(!SK.param.FindByIdNoOops(hp)) {
+            ssys->result = SLVS_RESULT_INVALID;
+            if(ssys->failed) ssys->faileds = 0;
+            return;
+        }
+    }
+    SolveLoaded(ctx, ssys, shg);
+}
+
+void Slvs_GetSolveStats(Slvs_Context *ctx, Slvs_SolveStats *ss)
+{
+    const SolveStats &st = ctx->sys.stats;
+    ss->equations     = st.equations;
+    ss->params        = st.params;
+    ss->substituted   = st.substituted;
+    ss->alone         = st.alone;
+    ss->systems       = (int)st.systems.size();
+    ss->largestSystem = 0;
+    for(int m : st.systems) {
+        ss->largestSystem = max(ss->largestSystem, m);
+    }
+    ss->iterations    = st.iterations;
+    if(ss->residual) {
+        for(int i = 0; i < ss->residuals && i < (int)st.residual.size(); i++) {
+            ss->residual[i] = st.residual[i];
+        }
+    }
+    ss->residuals     = (int)st.residual.size();
+    ss->writeJacobianTime = st.writeJacobianTime;
+    ss->evalJacobianTime  = st.evalJacobianTime;
+    ss->solveTime         = st.solveTime;
+    ss->rankTime          = st.rankTime;
+    ss->totalTime         = st.totalTime;
+}
+
+void Slvs_SetDamped(Slvs_Context *ctx, int damped)
+{
+    ctx->damped = damped ? true : false;
+}
+
+void Slvs_SolveBatch(const Slvs_System *ssys, Slvs_hGroup shg, Slvs_Batch *batch)
+{
+    std::call_once(InitOnce, [] { InitPlatform(0, NULL); });
+
+    int runs = (batch->scenarios + BATCH_RUN - 1) / BATCH_RUN;
+    int threads = std::min((int)std::thread::hardware_concurrency(), runs);
+
+    std::atomic<int> next(0);
+    std::vector<std::thread> workers;
+    for(int t = 1; t < threads; t++) {
+        workers.emplace_back(SolveBatchRuns, ssys, shg, batch, &next);
+    }
+    SolveBatchRuns(ssys, shg, batch, &next);
+    for(std::thread &w : workers) {
+        w.join();
+    }
+}
+
 } /* extern "C" */
@@ -25,6 +25,10 @@ Common options:
         piecewise linear, and exact surfaces into triangle meshes.
         For export commands, the unit is mm, and the default is 1.0 mm.
         For non-export commands, the unit is %%, and the default is 1.0 %%.
+    -s, --solve-stats
+        After loading each file, prints what the solver did for each group:
+        the size of the system of equations, the Newton steps taken, and
+        the time spent in each part of the solve.
 
 Commands:
     thumbnail --output <pattern> --size <size> --view <direction>
@@ -155,6 +159,14 @@ static bool RunCommand(const std::vector<std::string> args) {
         } else return false;
     };
 
+    bool solveStats = false;
+    auto ParseSolveStats = [&](size_t &argn) {
+        if(args[argn] == "--solve-stats" || args[argn] == "-s") {
+            solveStats = true;
+            return true;
+        } else return false;
+    };
+
     unsigned width = 0, height = 0;
     if(args[1] == "thumbnail") {
         auto ParseSize = [&](size_t &argn) {
@@ -171,7 +183,8 @@ static bool RunCommand(const std::vector<std::string> args) {
                  ParseOutputPattern(argn) ||
                  ParseViewDirection(argn) ||
                  ParseChordTolerance(argn) ||
-                 ParseSize(argn))) {
+                 ParseSize(argn) ||
+                 ParseSolveStats(argn))) {
                 fprintf(stderr, "Unrecognized option '%s'.\n", args[argn].c_str());
                 return false;
             }
@@ -221,7 +234,8 @@ static bool RunCommand(const std::vector<std::string> args) {
             if(!(ParseInputFile(argn) ||
                  ParseOutputPattern(argn) ||
                  ParseViewDirection(argn) ||
-                 ParseChordTolerance(argn))) {
+                 ParseChordTolerance(argn) ||
+                 ParseSolveStats(argn))) {
                 fprintf(stderr, "Unrecognized option '%s'.\n", args[argn].c_str());
                 return false;
             }
@@ -243,7 +257,8 @@ static bool RunCommand(const std::vector<std::string> args) {
         for(size_t argn = 2; argn < args.size(); argn++) {
             if(!(ParseInputFile(argn) ||
                  ParseOutputPattern(argn) ||
-                 ParseChordTolerance(argn))) {
+                 ParseChordTolerance(argn) ||
+                 ParseSolveStats(argn))) {
                 fprintf(stderr, "Unrecognized option '%s'.\n", args[argn].c_str());
                 return false;
             }
@@ -258,7 +273,8 @@ static bool RunCommand(const std::vector<std::string> args) {
         for(size_t argn = 2; argn < args.size(); argn++) {
             if(!(ParseInputFile(argn) ||
                  ParseOutputPattern(argn) ||
-                 ParseChordTolerance(argn))) {
+                 ParseChordTolerance(argn) ||
+                 ParseSolveStats(argn))) {
                 fprintf(stderr, "Unrecognized option '%s'.\n", args[argn].c_str());
                 return false;
             }
@@ -272,7 +288,8 @@ static bool RunCommand(const std::vector<std::string> args) {
     } else if(args[1] == "export-surfaces") {
         for(size_t argn = 2; argn < args.size(); argn++) {
             if(!(ParseInputFile(argn) ||
-                 ParseOutputPattern(argn))) {
+                 ParseOutputPattern(argn) ||
+                 ParseSolveStats(argn))) {
                 fprintf(stderr, "Unrecognized option '%s'.\n", args[argn].c_str());
                 return false;
             }
@@ -285,7 +302,8 @@ static bool RunCommand(const std::vector<std::string> args) {
     } else if(args[1] == "regenerate") {
         for(size_t argn = 2; argn < args.size(); argn++) {
             if(!(ParseInputFile(argn) ||
-                 ParseChordTolerance(argn))) {
+                 ParseChordTolerance(argn) ||
+                 ParseSolveStats(argn))) {
                 fprintf(stderr, "Unrecognized option '%s'.\n", args[argn].c_str());
                 return false;
             }
@@ -340,6 +358,32 @@ static bool RunCommand(const std::vector<std::string> args) {
             return false;
         }
         SS.AfterNewFile();
+        if(solveStats) {
+            for(hGroup hg : SK.groupOrder) {
+                if(hg == Group::HGROUP_REFERENCES) continue;
+
+                Group *g = SK.GetGroup(hg);
+                const SolveStats &st = g->solved.stats;
+                fprintf(stderr, "%s: group '%s'\n",
+                        inputFile.raw.c_str(), g->DescriptionString().c_str());
+                fprintf(stderr, "  %d equations in %d params, %d substituted, "
+                                "%d solved alone\n",
+                        st.equations, st.params, st.substituted, st.alone);
+                fprintf(stderr, "  %d systems:", (int)st.systems.size());
+                for(int m : st.systems) {
+                    fprintf(stderr, " %d", m);
+                }
+                fprintf(stderr, "\n  %d Newton steps, residual:", st.iterations);
+                for(double r : st.residual) {
+                    fprintf(stderr, " %.1e", r);
+                }
+                fprintf(stderr, "\n  %.3f ms writing Jacobian, %.3f ms evaluating it, "
+                                "%.3f ms in least squares,\n"
+                                "  %.3f ms in rank tests, %.3f ms in all\n",
+                        st.writeJacobianTime, st.evalJacobianTime, st.solveTime,
+                        st.rankTime, st.totalTime);
+            }
+        }
         runner(absOutputFile);
         SK.Clear();
         SS.Clear();
@@ -98,6 +98,7 @@ public:
     //      31:16   -- request index
     uint32_t v;
 
+    inline bool isFromRequest() const;
     inline hRequest request() const;
 };
 
@@ -175,6 +176,7 @@ public:
     bool        suppress;
     bool        relaxConstraints;
     bool        allowRedundant;
+    bool        dampedSolve;
     bool        allDimsReference;
     double      scale;
 
@@ -190,6 +192,7 @@ public:
         SolveResult         how;
         int                 dof;
         List<hConstraint>   remove;
+        SolveStats          stats;
     } solved;
 
     enum class Subtype : uint32_t {
@@ -680,6 +683,9 @@ public:
     // These are the parameters for the constraint.
     double      valA;
     hParam      valP;
+    // If set, the equations read valA from this param instead, so that it
+    // can change without changing the equations.
+    hParam      valAParam;
     hEntity     ptA;
     hEntity     ptB;
     hEntity     entityA;
@@ -694,7 +700,8 @@ public:
 
     bool Equals(const ConstraintBase &c) const {
         return type == c.type && group == c.group && workplane == c.workplane &&
-            valA == c.valA && valP == c.valP && ptA == c.ptA && ptB == c.ptB &&
+            valA == c.valA && valP == c.valP && valAParam == c.valAParam &&
+            ptA == c.ptA && ptB == c.ptB &&
             entityA == c.entityA && entityB == c.entityB &&
             entityC == c.entityC && entityD == c.entityD &&
             other == c.other && other2 == c.other2 && reference == c.reference &&
@@ -804,6 +811,10 @@ public:
 
     Expr        *e;
 
+    // Used only in the solver: the params that e depends upon, by their
+    // index in the solver's param table, sorted and without duplicates.
+    std::vector<int> params;
+
     void Clear() {}
 };
 
@@ -942,6 +953,8 @@ inline hGroup hEntity::group() const
 inline hEquation hEntity::equation(int i) const
     { hEquation r; r.v = v | 0x40000000 | (uint32_t)i; return r; }
 
+inline bool hParam::isFromRequest() const
+    { if(v & 0xc0000000) return false; else return true; }
 inline hRequest hParam::request() const
     { hRequest r; r.v = (v >> 16); return r; }
 
@@ -972,10 +972,8 @@ PACKAGE_VERSION, 2019);
 
 void SolveSpaceUI::Clear() {
     sys.Clear();
-    for(int i = 0; i < MAX_UNDO; i++) {
-        if(i < undo.cnt) undo.d[i].Clear();
-        if(i < redo.cnt) redo.d[i].Clear();
-    }
+    UndoClearStack(&undo);
+    UndoClearStack(&redo);
     TW.window = NULL;
     GW.openRecentMenu = NULL;
     GW.linkRecentMenu = NULL;
@@ -18,14 +18,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <deque>
 #include <functional>
 #include <locale>
 #include <map>
 #include <memory>
+#include <queue>
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -148,8 +152,6 @@ void dbp(const char *str, ...);
 
 std::vector<std::string> InitPlatform(int argc, char **argv);
 
-void *AllocTemporary(size_t n);
-void FreeAllTemporary();
 void *MemAlloc(size_t n);
 void MemFree(void *p);
 void vl(); // debug function to validate heaps
@@ -157,6 +159,25 @@ void vl(); // debug function to validate heaps
 // End of platform-specific functions
 //================
 
+void *AllocTemporary(size_t n);
+void FreeAllTemporary();
+
+// Everything allocated with AllocTemporary() during the life of a scope is
+// freed at its end, so that a part of the work can give its memory back
+// early. Scopes nest.
+class TemporaryScope {
+public:
+    TemporaryScope();
+    ~TemporaryScope();
+
+    TemporaryScope(const TemporaryScope &) = delete;
+    TemporaryScope &operator=(const TemporaryScope &) = delete;
+
+private:
+    size_t chunk;
+    size_t used;
+};
+
 #include "resource.h"
 
 enum class Unit : uint32_t {
@@ -186,8 +207,32 @@ enum class SolveResult : uint32_t {
     OKAY                     = 0,
     DIDNT_CONVERGE           = 10,
     REDUNDANT_OKAY           = 11,
-    REDUNDANT_DIDNT_CONVERGE = 12,
-    TOO_MANY_UNKNOWNS        = 20
+    REDUNDANT_DIDNT_CONVERGE = 12
+};
+
+// What the solver did for a group, and where it spent its time, so that we
+// can see which sketches are slow and why. Times are in milliseconds.
+class SolveStats {
+public:
+    int                 equations;
+    int                 params;
+    int                 substituted;    // params eliminated by substitution
+    int                 alone;          // equations solved alone
+    std::vector<int>    systems;        // equations in each of the others
+    bool                reused;         // symbolic work kept from last time
+    bool                unchanged;      // and the equations not even written
+    int                 recompiled;     // kept systems with new constants
+
+    int                 iterations;     // Newton steps, in all the systems
+    // The largest residual before the first step and after each one, of
+    // the system that took the most steps
+    std::vector<double> residual;
+
+    double              writeJacobianTime;
+    double              evalJacobianTime;
+    double              solveTime;      // in SolveLeastSquares()
+    double              rankTime;
+    double              totalTime;
 };
 
 
@@ -233,8 +278,6 @@ void Error(const char *fmt, ...);
 
 class System {
 public:
-    enum { MAX_UNKNOWNS = 1024 };
-
     EntityList                      entity;
     ParamList                       param;
     IdList<Equation,hEquation>      eq;
@@ -245,60 +288,148 @@ public:
 
     enum {
         // In general, the tag indicates the subsys that a variable/equation
-        // has been assigned to; these are exceptions for variables:
-        VAR_SUBSTITUTED      = 10000,
-        VAR_DOF_TEST         = 10001,
+        // has been assigned to; these are exceptions (negative, so that they
+        // can't collide with a subsys number) for variables:
+        VAR_SUBSTITUTED      = -1,
+        VAR_DOF_TEST         = -2,
         // and for equations:
-        EQ_SUBSTITUTED       = 20000
+        EQ_SUBSTITUTED       = -3
     };
 
-    // The system Jacobian matrix
-    struct {
+    // The Jacobian matrix of a system of equations, and the routines to
+    // solve that system.
+    class Matrix {
+    public:
         // The corresponding equation for each row
-        hEquation   eq[MAX_UNKNOWNS];
+        std::vector<hEquation>  eq;
 
         // The corresponding parameter for each column
-        hParam      param[MAX_UNKNOWNS];
+        std::vector<Param *>    param;
 
         // We're solving AX = B
         int m, n;
         struct {
-            Expr        *sym[MAX_UNKNOWNS][MAX_UNKNOWNS];
-            double       num[MAX_UNKNOWNS][MAX_UNKNOWNS];
+            // Only the nonzero partials are stored, row by row; the entries
+            // of row i are [rowStart[i], rowStart[i+1]), in order of column.
+            // We also index them by column; the entries of column j are
+            // colEntry[k], in row colRow[k], for k in [colStart[j],
+            // colStart[j+1]).
+            std::vector<int>        rowStart;
+            std::vector<int>        col;
+            std::vector<int>        colStart;
+            std::vector<int>        colEntry;
+            std::vector<int>        colRow;
+
+            std::vector<double>     num;
         }           A;
 
-        double      scale[MAX_UNKNOWNS];
+        std::vector<double>     scale;
 
         // Some helpers for the least squares solve
-        double AAt[MAX_UNKNOWNS][MAX_UNKNOWNS];
-        double Z[MAX_UNKNOWNS];
+        SparseSymmetricMatrix   AAt;
+        std::vector<double>     Z;
 
-        double      X[MAX_UNKNOWNS];
+        std::vector<double>     X;
 
         struct {
-            Expr        *sym[MAX_UNKNOWNS];
-            double       num[MAX_UNKNOWNS];
+            ExprTape                sym;
+            ExprBatch               batch;
+            std::vector<double>     num;
         }           B;
-    } mat;
+
+        void EvalJacobian();
+        void WriteAAt();
+        int CalculateRank();
+        bool TestRank(int *rank = NULL);
+        bool SolveLeastSquares();
+        bool NewtonSolve();
+        bool DampedNewtonSolve();
+        void FindUnsatisfied(List<hConstraint> *bad);
+        void FindRemovable(std::unordered_set<uint32_t> *constraints) const;
+        void Rebind(IdList<Param,hParam> *table);
+
+        // Take steps within a trust region (dogleg), instead of full ones
+        bool damped = false;
+
+        // What the last solve did, for the SolveStats
+        struct {
+            int                 iterations;
+            std::vector<double> residual;
+            double              evalJacobianTime;
+            double              solveTime;
+            double              rankTime;
+        }           stats = {};
+        double Residual() const;
+
+        // The outcome of SolveAndTestRank()
+        bool converged, rankOk;
+        int rank;
+        void SolveAndTestRank();
+    };
+
+    // The system that we're working on
+    Matrix mat;
+
+    // What the last Solve() did
+    SolveStats stats;
+
+    // The symbolic work to solve a group: the substitutions, and the systems
+    // that we solve, written and compiled. That depends only on the form of
+    // the equations, so we keep it for as long as that stays the same, like
+    // while dragging or changing a dimension; and if nothing that the
+    // equations are written from has changed, we don't write them at all.
+    class Structure {
+    public:
+        // What the equations are written from, and their form
+        std::vector<uint64_t>   inputs;
+        std::vector<uint64_t>   key;
+        // The constants in each equation, from constantStart[i] on, which
+        // are compiled in to the systems but aren't part of the key
+        std::vector<uint64_t>   constant;
+        std::vector<int>        constantStart;
+        std::vector<hEquation>  eq;
+
+        // The tags of the params and equations, in order of the tables
+        std::vector<int>        paramTag;
+        std::vector<hParam>     substd;
+        std::vector<int>        eqTag;
+
+        // The equations that are soluble alone, then everything else
+        std::vector<Matrix>     alone;
+        std::vector<Matrix>     systems;
+
+        // Whether we've solved with this since ForgetUnusedStructures()
+        bool                    used = false;
+    };
+    std::map<uint32_t, Structure> structure;    // by group
+
+    void WriteInputsKey(Group *g, bool forceDofCheck, std::vector<uint64_t> *key);
+    void WriteStructureKey(bool forceDofCheck, std::vector<uint64_t> *key,
+                           std::vector<uint64_t> *constant,
+                           std::vector<int> *constantStart);
+    void WriteStructure(Structure *st, bool forceDofCheck);
+    void ReuseStructure(Structure *st);
+    bool RecompileForConstants(Structure *st, const std::vector<uint64_t> &constant,
+                               const std::vector<int> &constantStart);
+    void ForgetUnusedStructures();
 
     static const double RANK_MAG_TOLERANCE, CONVERGE_TOLERANCE;
-    int CalculateRank();
-    bool TestRank(int *rank = NULL);
-    static bool SolveLinearSystem(double X[], double A[][MAX_UNKNOWNS],
-                                  double B[], int N);
-    bool SolveLeastSquares();
+    static const int PARALLEL_MIN_ENTRIES;
+
+    // How many threads SolveInParallel() may use; zero for one per core.
+    unsigned threads = 0;
 
-    bool WriteJacobian(int tag);
-    void EvalJacobian();
+    void WriteJacobian(int tag, Matrix *m);
+    void SolveInParallel(std::vector<Matrix> *systems);
 
     void WriteEquationsExceptFor(hConstraint hc, Group *g);
-    void FindWhichToRemoveToFixJacobian(Group *g, List<hConstraint> *bad, bool forceDofCheck);
+    void FindWhichToRemoveToFixJacobian(Group *g, List<hConstraint> *bad);
     void SolveBySubstitution();
+    void WriteEquationParams();
+    int TagComponents(int tag);
 
     bool IsDragged(hParam p);
 
-    bool NewtonSolve(int tag);
-
     void MarkParamsFree(bool findFree);
     int CalculateDof();
 
@@ -517,6 +648,33 @@ public:
 
     BBox CalculateEntityBBox(bool includingInvisible);
     Group *GetRunningMeshGroupFor(hGroup h);
+
+    // The requests and constraints in each group, as indices into the lists
+    // above in order of handle; so that regenerating a group needn't filter
+    // through everything in the sketch. This is rebuilt, for all the groups
+    // at once, whenever either list has changed since it was last built.
+    struct GroupItems {
+        std::vector<int>    request;
+        std::vector<int>    constraint;
+    };
+    const GroupItems &ItemsInGroup(hGroup hg) {
+        if(groupItemsChanges[0] != request.Changes() ||
+           groupItemsChanges[1] != constraint.Changes()) {
+            groupItems.clear();
+            for(int i = 0; i < request.n; i++) {
+                groupItems[request[i].group].request.push_back(i);
+            }
+            for(int i = 0; i < constraint.n; i++) {
+                groupItems[constraint[i].group].constraint.push_back(i);
+            }
+            groupItemsChanges[0] = request.Changes();
+            groupItemsChanges[1] = constraint.Changes();
+        }
+        return groupItems[hg];
+    }
+private:
+    std::map<hGroup, GroupItems>    groupItems;
+    uint32_t                        groupItemsChanges[2] = {};
 };
 #undef ENTITY
 #undef CONSTRAINT
@@ -527,30 +685,29 @@ public:
     TextWindow                 &TW;
     GraphicsWindow              GW;
 
-    // The state for undo/redo
+    // The state for undo/redo. Unchanged items are shared between states,
+    // and so are whole lists of them, so each state only holds its own copy
+    // of what's changed since the one before; and we keep as many states as
+    // fit in UNDO_MEMORY_LIMIT.
+    template<class T>
+    using UndoItems = std::vector<std::shared_ptr<const T>>;
+    template<class T>
+    using UndoList = std::shared_ptr<const UndoItems<T>>;
     typedef struct {
-        IdList<Group,hGroup>            group;
-        List<hGroup>                    groupOrder;
-        IdList<Request,hRequest>        request;
-        IdList<Constraint,hConstraint>  constraint;
-        IdList<Param,hParam>            param;
-        IdList<Style,hStyle>            style;
-        hGroup                          activeGroup;
-
-        void Clear() {
-            group.Clear();
-            request.Clear();
-            constraint.Clear();
-            param.Clear();
-            style.Clear();
-        }
+        UndoList<Group>         group;
+        std::shared_ptr<const std::vector<hGroup>> groupOrder;
+        UndoList<Request>       request;
+        UndoList<Constraint>    constraint;
+        UndoList<std::vector<Param>> param;
+        UndoList<Style>         style;
+        hGroup                  activeGroup;
     } UndoState;
-    enum { MAX_UNDO = 16 };
-    typedef struct {
-        UndoState   d[MAX_UNDO];
-        int         cnt;
-        int         write;
-    } UndoStack;
+    enum { UNDO_MEMORY_LIMIT = 256 << 20 };
+    typedef std::deque<UndoState> UndoStack;
+    // The memory taken by the items and lists in all the states, counting
+    // each just once however many states share it; the states themselves
+    // take another sizeof(UndoState) each.
+    size_t      undoBytes;
     UndoStack   undo;
     UndoStack   redo;
 
@@ -564,7 +721,6 @@ public:
     void UndoRedo();
     void PushFromCurrentOnto(UndoStack *uk);
     void PopOntoCurrentFrom(UndoStack *uk);
-    void UndoClearState(UndoState *ut);
     void UndoClearStack(UndoStack *uk);
 
     // Little bits of extra configuration state
@@ -823,7 +979,14 @@ void ImportDxf(const Platform::Path &file);
 void ImportDwg(const Platform::Path &file);
 
 extern SolveSpaceUI SS;
+#ifdef LIBRARY
+// The library may be solving for several contexts at once, one per thread,
+// and each of those has its own sketch.
+extern thread_local Sketch *CurrentSketch;
+#   define SK (*SolveSpace::CurrentSketch)
+#else
 extern Sketch SK;
+#endif
 
 }
 
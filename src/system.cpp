@@ -7,6 +7,8 @@
 // Copyright 2008-2013 Jonathan Westhues.
 //-----------------------------------------------------------------------------
 #include "solvespace.h"
+#include <condition_variable>
+#include <mutex>
 
 // This tolerance is used to determine whether two (linearized) constraints
 // are linearly dependent. If this is too small, then we will attempt to
@@ -19,62 +21,127 @@ const double System::RANK_MAG_TOLERANCE = 1e-4;
 // always be much less than LENGTH_EPS, and in practice should be much less.
 const double System::CONVERGE_TOLERANCE = (LENGTH_EPS/(1e2));
 
-bool System::WriteJacobian(int tag) {
+// With fewer nonzero partials than this in all, it's not worth handing
+// independent systems to other threads to solve in parallel.
+const int System::PARALLEL_MIN_ENTRIES = 2000;
 
-    int j = 0;
-    for(auto &p : param) {
-        if(j >= MAX_UNKNOWNS)
-            return false;
+// For the stats; finer than GetMilliseconds().
+static double Milliseconds() {
+    auto timestamp = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration<double, std::milli>(timestamp).count();
+}
 
+void System::WriteJacobian(int tag, Matrix *m) {
+    double start = Milliseconds();
+
+    m->param.clear();
+    m->scale.clear();
+    for(auto &p : param) {
         if(p.tag != tag)
             continue;
-        mat.param[j] = p.h;
-        j++;
+
+        m->param.push_back(&p);
+        // Scale the columns; this scale weights the parameters for the least
+        // squares solve, so that we can encourage the solver to make bigger
+        // changes in some parameters, and smaller in others.
+        if(IsDragged(p.h)) {
+            // It's least squares, so this parameter doesn't need to be all
+            // that big to get a large effect.
+            m->scale.push_back(1/20.0);
+        } else {
+            m->scale.push_back(1);
+        }
     }
-    mat.n = j;
+    m->n = (int)m->param.size();
 
-    int i = 0;
+    // The column of each param in the table, if it has one
+    std::vector<int> column(param.n, -1);
+    for(int j = 0; j < m->n; j++) {
+        column[m->param[j] - param.begin()] = j;
+    }
 
+    m->eq.clear();
+    m->A.rowStart.clear();
+    m->A.col.clear();
+    m->B.sym.Clear();
     for(auto &e : eq) {
-        if(i >= MAX_UNKNOWNS) return false;
-
         if(e.tag != tag)
             continue;
 
-        mat.eq[i] = e.h;
+        m->eq.push_back(e.h);
+        m->A.rowStart.push_back((int)m->A.col.size());
         Expr *f   = e.e->DeepCopyWithParamsAsPointers(&param, &(SK.param));
         f = f->FoldConstants();
 
-        // Hash table (61 bits) to accelerate generation of zero partials.
-        uint64_t scoreboard = f->ParamsUsed();
-        for(j = 0; j < mat.n; j++) {
-            Expr *pd;
-            if(scoreboard & ((uint64_t)1 << (mat.param[j].v % 61)) &&
-                f->DependsOn(mat.param[j]))
-            {
-                pd = f->PartialWrt(mat.param[j]);
-                pd = pd->FoldConstants();
-                pd = pd->DeepCopyWithParamsAsPointers(&param, &(SK.param));
-            } else {
-                pd = Expr::From(0.0);
-            }
-            mat.A.sym[i][j] = pd;
+        // We get the partials by differentiating the tape, so the nonzero
+        // partials are those wrt the params that this equation reads; and
+        // there's one instruction to read each param, which is told its
+        // column.
+        const ExprTape::Output &o = m->B.sym.output[m->B.sym.Add(f)];
+        int rowStart = (int)m->A.col.size();
+        for(int n = o.start; n < o.end; n++) {
+            ExprTape::Instruction *i = &m->B.sym.code[m->B.sym.needs[n]];
+            if(i->op != Expr::Op::PARAM_PTR) continue;
+
+            Param *p = param.FindByIdNoOops(i->p->h);
+            if(p != i->p) continue;
+            i->a = column[p - param.begin()];
+            if(i->a >= 0) m->A.col.push_back(i->a);
         }
-        mat.B.sym[i] = f;
-        i++;
+        std::sort(m->A.col.begin() + rowStart, m->A.col.end());
+    }
+    m->m = (int)m->eq.size();
+    m->A.rowStart.push_back((int)m->A.col.size());
+    m->A.num.resize(m->A.col.size());
+    m->B.num.resize(m->m);
+
+    // We evaluate the equations in batches of the same shape, writing each
+    // partial straight to its entry in A.
+    m->B.batch.Build(m->B.sym, [&](int k, const ExprTape::Instruction &i) {
+        if(i.a < 0) return -1;
+        auto first = m->A.col.begin() + m->A.rowStart[k],
+             last  = m->A.col.begin() + m->A.rowStart[k + 1];
+        return (int)(std::lower_bound(first, last, i.a) - m->A.col.begin());
+    });
+
+    // And index the nonzero entries by column too.
+    m->A.colStart.assign(m->n + 1, 0);
+    for(int j : m->A.col) {
+        m->A.colStart[j + 1]++;
+    }
+    for(int j = 0; j < m->n; j++) {
+        m->A.colStart[j + 1] += m->A.colStart[j];
     }
-    mat.m = i;
+    m->A.colEntry.resize(m->A.col.size());
+    m->A.colRow.resize(m->A.col.size());
+    std::vector<int> next(m->A.colStart.begin(), m->A.colStart.end() - 1);
+    for(int i = 0; i < m->m; i++) {
+        for(int k = m->A.rowStart[i]; k < m->A.rowStart[i + 1]; k++) {
+            int kc = next[m->A.col[k]]++;
+            m->A.colEntry[kc] = k;
+            m->A.colRow[kc]   = i;
+        }
+    }
+    stats.writeJacobianTime += Milliseconds() - start;
+}
 
-    return true;
+void System::Matrix::EvalJacobian() {
+    double start = Milliseconds();
+
+    // Differentiating needs the value of everything at our operating point,
+    // so evaluate the functions too.
+    B.batch.Eval(B.num.data(), A.num.data());
+    stats.evalJacobianTime += Milliseconds() - start;
 }
 
-void System::EvalJacobian() {
-    int i, j;
-    for(i = 0; i < mat.m; i++) {
-        for(j = 0; j < mat.n; j++) {
-            mat.A.num[i][j] = (mat.A.sym[i][j])->Eval();
-        }
+// The largest error in any equation, as B is now; that's what has to be
+// within CONVERGE_TOLERANCE.
+double System::Matrix::Residual() const {
+    double residual = 0.0;
+    for(int i = 0; i < m; i++) {
+        residual = max(residual, ffabs(B.num[i]));
     }
+    return residual;
 }
 
 bool System::IsDragged(hParam p) {
@@ -85,7 +152,45 @@ bool System::IsDragged(hParam p) {
     return false;
 }
 
+//-----------------------------------------------------------------------------
+// Replace each substituted param in an expression by the one that it was
+// substituted with.
+//-----------------------------------------------------------------------------
+static void SubstituteParams(Expr *e, IdList<Param,hParam> *param) {
+    ssassert(e->op != Expr::Op::PARAM_PTR,
+             "Expected an expression that refer to params via handles");
+
+    if(e->op == Expr::Op::PARAM) {
+        Param *p = param->FindByIdNoOops(e->parh);
+        if(p && p->tag == System::VAR_SUBSTITUTED) {
+            e->parh = p->substd;
+        }
+    }
+    int c = e->Children();
+    if(c >= 1) SubstituteParams(e->a, param);
+    if(c >= 2) SubstituteParams(e->b, param);
+}
+
+//-----------------------------------------------------------------------------
+// Substitute away the params that equations like a - b = 0 make equal. The
+// params that are made equal form classes, which we track with a union-find;
+// the root of each class is the param that stays, and the others are
+// substituted with it. Then the equations are rewritten once, at the end.
+//-----------------------------------------------------------------------------
 void System::SolveBySubstitution() {
+    // By index in the param table
+    std::vector<int> parent(param.n);
+    for(int j = 0; j < param.n; j++) {
+        parent[j] = j;
+    }
+    auto root = [&](int j) {
+        while(parent[j] != j) {
+            parent[j] = parent[parent[j]];
+            j = parent[j];
+        }
+        return j;
+    };
+
     for(auto &teq : eq) {
         Expr *tex = teq.e;
 
@@ -93,195 +198,233 @@ void System::SolveBySubstitution() {
            tex->a->op == Expr::Op::PARAM &&
            tex->b->op == Expr::Op::PARAM)
         {
-            hParam a = tex->a->parh;
-            hParam b = tex->b->parh;
-            if(!(param.FindByIdNoOops(a) && param.FindByIdNoOops(b))) {
+            Param *pa = param.FindByIdNoOops(tex->a->parh);
+            Param *pb = param.FindByIdNoOops(tex->b->parh);
+            if(!(pa && pb)) {
                 // Don't substitute unless they're both solver params;
                 // otherwise it's an equation that can be solved immediately,
                 // or an error to flag later.
                 continue;
             }
 
-            if(IsDragged(a)) {
+            int a = root((int)(pa - param.begin())),
+                b = root((int)(pb - param.begin()));
+            if(IsDragged(param[a].h)) {
                 // A is being dragged, so A should stay, and B should go
                 std::swap(a, b);
             }
 
-            for(auto &req : eq) {
-                req.e->Substitute(a, b); // A becomes B, B unchanged
-            }
-            for(auto &rp : param) {
-                if(rp.substd == a) {
-                    rp.substd = b;
-                }
-            }
-            Param *ptr = param.FindById(a);
-            ptr->tag = VAR_SUBSTITUTED;
-            ptr->substd = b;
+            // A becomes B, B unchanged. If they're already the same, then
+            // the param is marked as substituted with itself, which holds
+            // it where it is.
+            parent[a] = b;
+            param[a].tag = VAR_SUBSTITUTED;
 
             teq.tag = EQ_SUBSTITUTED;
         }
     }
+
+    for(int j = 0; j < param.n; j++) {
+        if(param[j].tag == VAR_SUBSTITUTED) {
+            param[j].substd = param[root(j)].h;
+        }
+    }
+    for(auto &e : eq) {
+        SubstituteParams(e.e, &param);
+    }
 }
 
 //-----------------------------------------------------------------------------
-// Calculate the rank of the Jacobian matrix, by Gram-Schimdt orthogonalization
-// in place. A row (~equation) is considered to be all zeros if its magnitude
-// is less than the tolerance RANK_MAG_TOLERANCE.
+// Record, for each equation, the columns (as indices in the param table) that
+// it references, so the partitioning below doesn't have to walk the
+// expressions again. Params that have been substituted away are no longer
+// referenced, so this must come after SolveBySubstitution.
 //-----------------------------------------------------------------------------
-int System::CalculateRank() {
-    // Actually work with magnitudes squared, not the magnitudes
-    double rowMag[MAX_UNKNOWNS] = {};
-    double tol = RANK_MAG_TOLERANCE*RANK_MAG_TOLERANCE;
-
-    int i, iprev, j;
-    int rank = 0;
-
-    for(i = 0; i < mat.m; i++) {
-        // Subtract off this row's component in the direction of any
-        // previous rows
-        for(iprev = 0; iprev < i; iprev++) {
-            if(rowMag[iprev] <= tol) continue; // ignore zero rows
-
-            double dot = 0;
-            for(j = 0; j < mat.n; j++) {
-                dot += (mat.A.num[iprev][j]) * (mat.A.num[i][j]);
-            }
-            for(j = 0; j < mat.n; j++) {
-                mat.A.num[i][j] -= (dot/rowMag[iprev])*mat.A.num[iprev][j];
-            }
-        }
-        // Our row is now normal to all previous rows; calculate the
-        // magnitude of what's left
-        double mag = 0;
-        for(j = 0; j < mat.n; j++) {
-            mag += (mat.A.num[i][j]) * (mat.A.num[i][j]);
-        }
-        if(mag > tol) {
-            rank++;
+void System::WriteEquationParams() {
+    std::vector<hParam> used;
+    for(auto &e : eq) {
+        e.params.clear();
+        if(e.tag != 0) continue;
+
+        used.clear();
+        e.e->ParamsUsedList(&used);
+        for(hParam hp : used) {
+            Param *p = param.FindByIdNoOops(hp);
+            if(!p) continue;
+            e.params.push_back((int)(p - param.begin()));
         }
-        rowMag[i] = mag;
+        std::sort(e.params.begin(), e.params.end());
+        e.params.erase(std::unique(e.params.begin(), e.params.end()),
+                       e.params.end());
     }
-
-    return rank;
 }
 
-bool System::TestRank(int *rank) {
-    EvalJacobian();
-    int jacobianRank = CalculateRank();
-    if(rank) *rank = jacobianRank;
-    return jacobianRank == mat.m;
-}
-
-bool System::SolveLinearSystem(double X[], double A[][MAX_UNKNOWNS],
-                               double B[], int n)
-{
-    // Gaussian elimination, with partial pivoting. It's an error if the
-    // matrix is singular, because that means two constraints are
-    // equivalent.
-    int i, j, ip, jp, imax = 0;
-    double max, temp;
-
-    for(i = 0; i < n; i++) {
-        // We are trying eliminate the term in column i, for rows i+1 and
-        // greater. First, find a pivot (between rows i and N-1).
-        max = 0;
-        for(ip = i; ip < n; ip++) {
-            if(ffabs(A[ip][i]) > max) {
-                imax = ip;
-                max = ffabs(A[ip][i]);
-            }
-        }
-        // Don't give up on a singular matrix unless it's really bad; the
-        // assumption code is responsible for identifying that condition,
-        // so we're not responsible for reporting that error.
-        if(ffabs(max) < 1e-20) continue;
-
-        // Swap row imax with row i
-        for(jp = 0; jp < n; jp++) {
-            swap(A[i][jp], A[imax][jp]);
+//-----------------------------------------------------------------------------
+// Split the untagged equations into independent systems: two equations are
+// in the same system if they have an untagged parameter in common, directly
+// or through other equations. Each system is tagged along with its params,
+// starting from the given tag; params that appear in no equation stay
+// untagged. Returns the first tag not used.
+//-----------------------------------------------------------------------------
+int System::TagComponents(int tag) {
+    // A union-find over the params, by their index in the param table.
+    std::vector<int> parent(param.n);
+    for(int j = 0; j < param.n; j++) {
+        parent[j] = j;
+    }
+    auto root = [&](int j) {
+        while(parent[j] != j) {
+            parent[j] = parent[parent[j]];
+            j = parent[j];
         }
-        swap(B[i], B[imax]);
-
-        // For rows i+1 and greater, eliminate the term in column i.
-        for(ip = i+1; ip < n; ip++) {
-            temp = A[ip][i]/A[i][i];
+        return j;
+    };
 
-            for(jp = i; jp < n; jp++) {
-                A[ip][jp] -= temp*(A[i][jp]);
+    // Join the params of each equation, and remember one of them, or -1 if
+    // the equation doesn't have any.
+    std::vector<int> eqParam;
+    for(auto &e : eq) {
+        int r = -1;
+        if(e.tag == 0) {
+            for(int j : e.params) {
+                if(param[j].tag != 0) continue;
+
+                int rp = root(j);
+                if(r < 0) {
+                    r = rp;
+                } else if(rp != r) {
+                    parent[rp] = r;
+                }
             }
-            B[ip] -= temp*B[i];
         }
+        eqParam.push_back(r);
     }
 
-    // We've put the matrix in upper triangular form, so at this point we
-    // can solve by back-substitution.
-    for(i = n - 1; i >= 0; i--) {
-        if(ffabs(A[i][i]) < 1e-20) continue;
+    // And number the systems in the order that they appear.
+    std::vector<int> rootTag(param.n, 0);
+    int i = 0;
+    for(auto &e : eq) {
+        int r = eqParam[i++];
+        if(e.tag != 0) continue;
 
-        temp = B[i];
-        for(j = n - 1; j > i; j--) {
-            temp -= X[j]*A[i][j];
+        if(r < 0) {
+            // An equation in no unknowns is a (probably inconsistent)
+            // system by itself.
+            e.tag = tag++;
+            continue;
+        }
+        r = root(r);
+        if(rootTag[r] == 0) {
+            rootTag[r] = tag++;
         }
-        X[i] = temp / A[i][i];
+        e.tag = rootTag[r];
     }
+    for(int j = 0; j < param.n; j++) {
+        if(param[j].tag != 0) continue;
 
-    return true;
+        param[j].tag = rootTag[root(j)];
+    }
+    return tag;
 }
 
-bool System::SolveLeastSquares() {
-    int r, c, i;
-
-    // Scale the columns; this scale weights the parameters for the least
-    // squares solve, so that we can encourage the solver to make bigger
-    // changes in some parameters, and smaller in others.
-    for(c = 0; c < mat.n; c++) {
-        if(IsDragged(mat.param[c])) {
-            // It's least squares, so this parameter doesn't need to be all
-            // that big to get a large effect.
-            mat.scale[c] = 1/20.0;
-        } else {
-            mat.scale[c] = 1;
+//-----------------------------------------------------------------------------
+// Write A*A', which is sparse whenever A is; entry (r, c) is nonzero only if
+// equations r and c have some parameter in common.
+//-----------------------------------------------------------------------------
+void System::Matrix::WriteAAt() {
+    AAt.Clear(m);
+
+    std::vector<double> sum(m, 0.0);
+    std::vector<int> mark(m, -1);
+    std::vector<int> touched;
+    for(int r = 0; r < m; r++) {
+        touched.clear();
+        for(int k = A.rowStart[r]; k < A.rowStart[r + 1]; k++) {
+            int j = A.col[k];
+            for(int kc = A.colStart[j]; kc < A.colStart[j + 1]; kc++) {
+                int c = A.colRow[kc];
+                if(mark[c] != r) {
+                    mark[c] = r;
+                    touched.push_back(c);
+                }
+                sum[c] += A.num[k]*A.num[A.colEntry[kc]];
+            }
         }
-        for(r = 0; r < mat.m; r++) {
-            mat.A.num[r][c] *= mat.scale[c];
+        std::sort(touched.begin(), touched.end());
+        for(int c : touched) {
+            if(c == r) {
+                AAt.diag[r] = sum[c];
+            } else {
+                AAt.row[r].push_back({ c, sum[c] });
+            }
+            sum[c] = 0.0;
         }
     }
+}
 
-    // Write A*A'
-    for(r = 0; r < mat.m; r++) {
-        for(c = 0; c < mat.m; c++) {  // yes, AAt is square
-            double sum = 0;
-            for(i = 0; i < mat.n; i++) {
-                sum += mat.A.num[r][i]*mat.A.num[c][i];
-            }
-            mat.AAt[r][c] = sum;
-        }
+//-----------------------------------------------------------------------------
+// Calculate the rank of the Jacobian matrix. This is the rank of A*A', whose
+// L*D*L' factorization is equivalent to Gram-Schmidt orthogonalization of
+// the rows of A; so the D of a row is its magnitude squared after it's made
+// normal to the rows before it. A row (~equation) is considered to be all
+// zeros if its magnitude is less than the tolerance RANK_MAG_TOLERANCE.
+//-----------------------------------------------------------------------------
+int System::Matrix::CalculateRank() {
+    WriteAAt();
+    return AAt.Factor(RANK_MAG_TOLERANCE*RANK_MAG_TOLERANCE);
+}
+
+bool System::Matrix::TestRank(int *rank) {
+    EvalJacobian();
+    double start = Milliseconds();
+    int jacobianRank = CalculateRank();
+    stats.rankTime += Milliseconds() - start;
+    if(rank) *rank = jacobianRank;
+    return jacobianRank == m;
+}
+
+bool System::Matrix::SolveLeastSquares() {
+    double start = Milliseconds();
+    int r, c;
+
+    // Scale the columns, to weight the parameters (see WriteJacobian()).
+    for(size_t k = 0; k < A.num.size(); k++) {
+        A.num[k] *= scale[A.col[k]];
     }
 
-    if(!SolveLinearSystem(mat.Z, mat.AAt, mat.B.num, mat.m)) return false;
+    // Write A*A', and solve A*A'*Z = B. It's not an error if the matrix is
+    // singular, because that means two constraints are equivalent; the
+    // assumption code is responsible for identifying that condition, so
+    // we're not responsible for reporting that error.
+    WriteAAt();
+    AAt.Factor(1e-20);
+    Z = B.num;
+    AAt.Solve(Z.data());
 
     // And multiply that by A' to get our solution.
-    for(c = 0; c < mat.n; c++) {
-        double sum = 0;
-        for(i = 0; i < mat.m; i++) {
-            sum += mat.A.num[i][c]*mat.Z[i];
+    X.assign(n, 0.0);
+    for(r = 0; r < m; r++) {
+        for(int k = A.rowStart[r]; k < A.rowStart[r + 1]; k++) {
+            X[A.col[k]] += A.num[k]*Z[r];
         }
-        mat.X[c] = sum * mat.scale[c];
     }
+    for(c = 0; c < n; c++) {
+        X[c] *= scale[c];
+    }
+    stats.solveTime += Milliseconds() - start;
     return true;
 }
 
-bool System::NewtonSolve(int tag) {
+bool System::Matrix::NewtonSolve() {
+    if(damped) return DampedNewtonSolve();
 
     int iter = 0;
     bool converged = false;
     int i;
 
     // Evaluate the functions at our operating point.
-    for(i = 0; i < mat.m; i++) {
-        mat.B.num[i] = (mat.B.sym[i])->Eval();
-    }
+    B.batch.Eval(B.num.data());
+    stats.residual.push_back(Residual());
     do {
         // And evaluate the Jacobian at our initial operating point.
         EvalJacobian();
@@ -290,9 +433,9 @@ bool System::NewtonSolve(int tag) {
 
         // Take the Newton step;
         //      J(x_n) (x_{n+1} - x_n) = 0 - F(x_n)
-        for(i = 0; i < mat.n; i++) {
-            Param *p = param.FindById(mat.param[i]);
-            p->val -= mat.X[i];
+        for(i = 0; i < n; i++) {
+            Param *p = param[i];
+            p->val -= X[i];
             if(isnan(p->val)) {
                 // Very bad, and clearly not convergent
                 return false;
@@ -300,16 +443,16 @@ bool System::NewtonSolve(int tag) {
         }
 
         // Re-evalute the functions, since the params have just changed.
-        for(i = 0; i < mat.m; i++) {
-            mat.B.num[i] = (mat.B.sym[i])->Eval();
-        }
+        B.batch.Eval(B.num.data());
+        stats.iterations++;
+        stats.residual.push_back(Residual());
         // Check for convergence
         converged = true;
-        for(i = 0; i < mat.m; i++) {
-            if(isnan(mat.B.num[i])) {
+        for(i = 0; i < m; i++) {
+            if(isnan(B.num[i])) {
                 return false;
             }
-            if(ffabs(mat.B.num[i]) > CONVERGE_TOLERANCE) {
+            if(ffabs(B.num[i]) > CONVERGE_TOLERANCE) {
                 converged = false;
                 break;
             }
@@ -319,11 +462,278 @@ bool System::NewtonSolve(int tag) {
     return converged;
 }
 
+//-----------------------------------------------------------------------------
+// Solve by Powell's dogleg method. The Newton step is taken only if it lies
+// within a trust region; otherwise we step to the edge of the region, along
+// a path that turns from the Newton step towards steepest descent of the
+// residual. A step is accepted only if it reduces the residual, and the
+// region grows or shrinks according to how well the linearization predicted
+// that reduction. A rejected step costs only an evaluation of the residual,
+// since the same Newton and steepest descent steps are used again in a
+// smaller region. Everything here is in the scaled parameters, so that the
+// dragged ones still move less.
+//-----------------------------------------------------------------------------
+bool System::Matrix::DampedNewtonSolve() {
+    int r, c;
+
+    auto magnitude = [](const std::vector<double> &v) {
+        double sum = 0.0;
+        for(double x : v) {
+            sum += x*x;
+        }
+        return sqrt(sum);
+    };
+    // The reduction in the residual that the linearization predicts, for a
+    // step in the scaled params.
+    auto predict = [&](const std::vector<double> &step) {
+        double reduction = 0.0;
+        for(r = 0; r < m; r++) {
+            double left = B.num[r];
+            for(int k = A.rowStart[r]; k < A.rowStart[r + 1]; k++) {
+                left -= A.num[k]*step[A.col[k]];
+            }
+            reduction += B.num[r]*B.num[r] - left*left;
+        }
+        return reduction;
+    };
+
+    B.batch.Eval(B.num.data());
+    stats.residual.push_back(Residual());
+    double residual = magnitude(B.num);
+    residual *= residual;
+    if(isnan(residual)) return false;
+
+    std::vector<double> newton(n), descent(n), step(n), val(n), prod(m), num;
+    double radius = -1.0;
+    for(int iter = 0; iter < 50; iter++) {
+        bool converged = true;
+        for(r = 0; r < m; r++) {
+            if(ffabs(B.num[r]) > CONVERGE_TOLERANCE) {
+                converged = false;
+                break;
+            }
+        }
+        if(converged) return true;
+
+        EvalJacobian();
+        if(!SolveLeastSquares()) return false;
+
+        // The Newton step, in the scaled params like A is now.
+        for(c = 0; c < n; c++) {
+            newton[c] = X[c]/scale[c];
+        }
+        // The steepest descent direction A'*B, and the distance along it
+        // that minimizes the linearized residual.
+        descent.assign(n, 0.0);
+        for(r = 0; r < m; r++) {
+            for(int k = A.rowStart[r]; k < A.rowStart[r + 1]; k++) {
+                descent[A.col[k]] += A.num[k]*B.num[r];
+            }
+        }
+        for(r = 0; r < m; r++) {
+            prod[r] = 0.0;
+            for(int k = A.rowStart[r]; k < A.rowStart[r + 1]; k++) {
+                prod[r] += A.num[k]*descent[A.col[k]];
+            }
+        }
+        double descentMag = magnitude(descent),
+               prodMag    = magnitude(prod);
+        if(prodMag == 0.0) return false;
+        double t = (descentMag*descentMag)/(prodMag*prodMag);
+        // If even that wouldn't reduce the residual by much, then we're at
+        // (or near) a minimum of the residual that isn't a solution.
+        if(t*descentMag*descentMag < 1e-6*residual) return false;
+        for(c = 0; c < n; c++) {
+            descent[c] *= t;
+        }
+        descentMag *= t;
+
+        double newtonMag = magnitude(newton);
+        if(radius < 0) {
+            // Trust the first Newton step, so that a well behaved system
+            // is solved just as with full steps.
+            radius = newtonMag;
+        }
+
+        for(;;) {
+            if(newtonMag <= radius) {
+                step = newton;
+            } else if(descentMag >= radius) {
+                for(c = 0; c < n; c++) {
+                    step[c] = descent[c]*(radius/descentMag);
+                }
+            } else {
+                // From the end of the descent step towards the Newton step,
+                // as far as the edge of the region.
+                double dd = 0.0, dn = 0.0;
+                for(c = 0; c < n; c++) {
+                    double d = newton[c] - descent[c];
+                    dd += d*d;
+                    dn += d*descent[c];
+                }
+                double rest = radius*radius - descentMag*descentMag;
+                double s = rest/(dn + sqrt(dn*dn + dd*rest));
+                for(c = 0; c < n; c++) {
+                    step[c] = descent[c] + s*(newton[c] - descent[c]);
+                }
+            }
+            double stepMag   = magnitude(step),
+                   predicted = predict(step);
+
+            for(c = 0; c < n; c++) {
+                Param *p = param[c];
+                val[c] = p->val;
+                p->val -= step[c]*scale[c];
+            }
+            num = B.num;
+            B.batch.Eval(B.num.data());
+            double stepResidual = magnitude(B.num);
+            stepResidual *= stepResidual;
+            if(stepResidual < residual && predicted > 0) {
+                double gain = (residual - stepResidual)/predicted;
+                if(gain > 0.75) {
+                    radius = max(radius, 3*stepMag);
+                } else if(gain < 0.25) {
+                    radius = stepMag/2;
+                }
+                residual = stepResidual;
+                stats.iterations++;
+                stats.residual.push_back(Residual());
+                break;
+            }
+
+            // The step made things worse (or was nan), so go back, and try
+            // again in a smaller region; but once the step is too small to
+            // matter, we're stuck.
+            for(c = 0; c < n; c++) {
+                param[c]->val = val[c];
+            }
+            B.num.swap(num);
+            radius = stepMag/2;
+            if(radius < CONVERGE_TOLERANCE) return false;
+        }
+    }
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+// Solve the system, and test its rank; that tells us if it's inconsistently
+// constrained. If it converges, then we want the rank at the solution, but
+// otherwise the rank where we started.
+//-----------------------------------------------------------------------------
+void System::Matrix::SolveAndTestRank() {
+    rankOk    = TestRank(&rank);
+    converged = NewtonSolve();
+    if(converged) {
+        rankOk = TestRank(&rank);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Threads kept waiting to help solve, so that we don't start new ones for
+// every solve, like on every step of a drag. Whoever hands them work does
+// some of it too, so they're shared by solves on different threads (in
+// different library contexts) without any waiting on another. They're
+// never destroyed, so that nothing has to join them while the program, or
+// the library, is being torn down.
+//-----------------------------------------------------------------------------
+namespace {
+class SolverThreads {
+    struct Job {
+        const std::function<void()> *work;
+        int running;
+    };
+
+    std::mutex              mutex;
+    std::condition_variable wake, done;
+    // A job appears once for every helper that it wants
+    std::deque<Job *>       queue;
+    unsigned                threads = 0;
+
+    void Help() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for(;;) {
+            wake.wait(lock, [&] { return !queue.empty(); });
+            Job *job = queue.front();
+            queue.pop_front();
+            job->running++;
+            lock.unlock();
+            (*job->work)();
+            lock.lock();
+            job->running--;
+            done.notify_all();
+        }
+    }
+
+public:
+    static SolverThreads *Get() {
+        static SolverThreads *st = new SolverThreads();
+        return st;
+    }
+
+    // Do work on this thread, and at the same time on up to helpers more;
+    // return once every one of them has finished it.
+    void Run(const std::function<void()> &work, unsigned helpers) {
+        Job job = { &work, 0 };
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for(; threads < helpers; threads++) {
+                std::thread(&SolverThreads::Help, this).detach();
+            }
+            queue.insert(queue.end(), helpers, &job);
+        }
+        wake.notify_all();
+        work();
+
+        // Any helper that hasn't started yet would find nothing left to do.
+        std::unique_lock<std::mutex> lock(mutex);
+        queue.erase(std::remove(queue.begin(), queue.end(), &job), queue.end());
+        done.wait(lock, [&] { return job.running == 0; });
+    }
+};
+}
+
+//-----------------------------------------------------------------------------
+// Solve a list of independent systems. When there's enough work, we share it
+// out among a few threads, biggest systems first. Each system is solved just
+// as it would be alone, and touches only its own params, so the results
+// don't depend on the number of threads or on which one solves what.
+//-----------------------------------------------------------------------------
+void System::SolveInParallel(std::vector<Matrix> *systems) {
+    std::vector<Matrix *> order;
+    size_t entries = 0;
+    for(Matrix &sys : *systems) {
+        order.push_back(&sys);
+        entries += sys.A.col.size();
+    }
+
+    unsigned threads = this->threads;
+    if(threads == 0) threads = std::thread::hardware_concurrency();
+    threads = min(threads, (unsigned)order.size());
+    if(threads < 2 || entries < (size_t)PARALLEL_MIN_ENTRIES) {
+        for(Matrix *sys : order) {
+            sys->SolveAndTestRank();
+        }
+        return;
+    }
+
+    std::stable_sort(order.begin(), order.end(), [](Matrix *a, Matrix *b) {
+        return a->A.col.size() > b->A.col.size();
+    });
+    std::atomic<size_t> next(0);
+    std::function<void()> work = [&]() {
+        size_t i;
+        while((i = next++) < order.size()) {
+            order[i]->SolveAndTestRank();
+        }
+    };
+    SolverThreads::Get()->Run(work, threads - 1);
+}
+
 void System::WriteEquationsExceptFor(hConstraint hc, Group *g) {
     // Generate all the equations from constraints in this group
-    for(auto &con : SK.constraint) {
-        ConstraintBase *c = &con;
-        if(c->group != g->h) continue;
+    for(int i : SK.ItemsInGroup(g->h).constraint) {
+        ConstraintBase *c = &SK.constraint[i];
         if(c->h == hc) continue;
 
         if(c->HasLabel() && c->type != Constraint::Type::COMMENT &&
@@ -354,13 +764,69 @@ void System::WriteEquationsExceptFor(hConstraint hc, Group *g) {
     g->GenerateEquations(&eq);
 }
 
-void System::FindWhichToRemoveToFixJacobian(Group *g, List<hConstraint> *bad, bool forceDofCheck) {
-    int a;
+//-----------------------------------------------------------------------------
+// Find the constraints that we could remove to make the Jacobian full rank.
+// That's from one rank test of the Jacobian of every equation, without any
+// substitution, so that the equations that we'd have solved by substitution
+// are rows like the rest; but most constraints can't help, and the
+// factorization tells us which can (see FindRemovable()).
+//-----------------------------------------------------------------------------
+void System::FindWhichToRemoveToFixJacobian(Group *g, List<hConstraint> *bad) {
+    // The substituted params didn't take part in the solve, so they're still
+    // where they started; move them to the solution, with the params that
+    // they were substituted with, which is where we test the rank.
+    for(auto &p : param) {
+        if(p.tag == VAR_SUBSTITUTED) {
+            p.val = param.FindById(p.substd)->val;
+        }
+    }
 
+    std::unordered_set<uint32_t> removable;
+    {
+        TemporaryScope scope;
+        param.ClearTags();
+        eq.Clear();
+        WriteEquationsExceptFor(Constraint::NO_CONSTRAINT, g);
+        eq.ClearTags();
+
+        WriteJacobian(0, &mat);
+        mat.EvalJacobian();
+        // A partial that isn't finite, like for a distance of zero between
+        // points made coincident, gives its equation no direction here; so
+        // take that equation's partials from where the sketch started, and
+        // if they're no better, count them as zero.
+        auto finite = [](double v) { return !(isnan(v) || isinf(v)); };
+        if(!std::all_of(mat.A.num.begin(), mat.A.num.end(), finite)) {
+            std::vector<double> solved = mat.A.num, val;
+            for(auto &p : param) {
+                val.push_back(p.val);
+                p.val = SK.GetParam(p.h)->val;
+            }
+            mat.EvalJacobian();
+            for(int r = 0; r < mat.m; r++) {
+                auto first = solved.begin() + mat.A.rowStart[r],
+                     last  = solved.begin() + mat.A.rowStart[r + 1];
+                if(std::all_of(first, last, finite)) {
+                    std::copy(first, last, mat.A.num.begin() + mat.A.rowStart[r]);
+                }
+            }
+            for(int j = 0; j < param.n; j++) {
+                param[j].val = val[j];
+            }
+        }
+        for(double &v : mat.A.num) {
+            if(!finite(v)) v = 0.0;
+        }
+        if(mat.CalculateRank() < mat.m) {
+            mat.FindRemovable(&removable);
+        }
+        eq.Clear();
+    }
+
+    int a;
     for(a = 0; a < 2; a++) {
-        for(auto &con : SK.constraint) {
-            ConstraintBase *c = &con;
-            if(c->group != g->h) continue;
+        for(int ci : SK.ItemsInGroup(g->h).constraint) {
+            ConstraintBase *c = &SK.constraint[ci];
             if((c->type == Constraint::Type::POINTS_COINCIDENT && a == 0) ||
                (c->type != Constraint::Type::POINTS_COINCIDENT && a == 1))
             {
@@ -369,147 +835,662 @@ void System::FindWhichToRemoveToFixJacobian(Group *g, List<hConstraint> *bad, bo
                 // constraints (so they appear last in the list).
                 continue;
             }
+            if(removable.count(c->h.v)) bad->Add(&(c->h));
+        }
+    }
+    param.ClearTags();
+}
 
-            param.ClearTags();
-            eq.Clear();
-            WriteEquationsExceptFor(c->h, g);
-            eq.ClearTags();
+//-----------------------------------------------------------------------------
+// Whether the columns of a small dense matrix, stored by rows, are
+// independent; by Gaussian elimination with partial pivoting, taking
+// anything no bigger than tol as zero.
+//-----------------------------------------------------------------------------
+static bool ColumnsIndependent(std::vector<double> *a, int rows, int cols, double tol) {
+    double *m = a->data();
+    for(int c = 0; c < cols; c++) {
+        int best = -1;
+        double mag = tol;
+        for(int r = c; r < rows; r++) {
+            if(ffabs(m[r*cols + c]) > mag) {
+                best = r;
+                mag  = ffabs(m[r*cols + c]);
+            }
+        }
+        if(best < 0) return false;
+        std::swap_ranges(m + best*cols, m + (best + 1)*cols, m + c*cols);
 
-            // It's a major speedup to solve the easy ones by substitution here,
-            // and that doesn't break anything.
-            if(!forceDofCheck) {
-                SolveBySubstitution();
+        for(int r = c + 1; r < rows; r++) {
+            double f = m[r*cols + c] / m[c*cols + c];
+            for(int k = c; k < cols; k++) {
+                m[r*cols + k] -= f*m[c*cols + k];
             }
+        }
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Add the constraints that we could remove, any one of them, to make this
+// system full rank, from the factorization of the last rank test. The
+// combinations of rows that sum to zero are spanned by the null vectors of
+// A*A', one for each pivot that the factorization skipped. Without some
+// constraint's rows, none of those combinations is left just when the null
+// vectors, restricted to its rows, are independent.
+//-----------------------------------------------------------------------------
+void System::Matrix::FindRemovable(std::unordered_set<uint32_t> *constraints) const {
+    std::unordered_map<uint32_t, std::vector<int>> rows;
+    size_t mostRows = 0;
+    for(int r = 0; r < m; r++) {
+        if(!eq[r].isFromConstraint()) continue;
+        std::vector<int> &rc = rows[eq[r].constraint().v];
+        rc.push_back(r);
+        mostRows = max(mostRows, rc.size());
+    }
+
+    // There can't be more independent null vectors than a constraint has
+    // rows, so with more than any has, removing just one won't do.
+    size_t nullity = 0;
+    for(double dk : AAt.d) {
+        if(dk == 0.0) nullity++;
+    }
+    if(nullity == 0 || nullity > mostRows) return;
+
+    // Each null vector is one at its own pivot, so anything much smaller
+    // than the biggest entry is roundoff.
+    std::vector<std::vector<double>> nullVectors;
+    double tol = 0.0;
+    for(int i = 0; i < (int)AAt.order.size(); i++) {
+        if(AAt.d[i] != 0.0) continue;
+        nullVectors.emplace_back(m);
+        AAt.NullVector(i, nullVectors.back().data());
+        for(double v : nullVectors.back()) {
+            tol = max(tol, ffabs(v));
+        }
+    }
+    tol *= 1e-10;
 
-            WriteJacobian(0);
-            EvalJacobian();
+    std::vector<double> restricted;
+    for(const auto &it : rows) {
+        const std::vector<int> &rc = it.second;
+        if(rc.size() < nullity) continue;
 
-            int rank = CalculateRank();
-            if(rank == mat.m) {
-                // We fixed it by removing this constraint
+        restricted.clear();
+        for(int r : rc) {
+            for(const std::vector<double> &x : nullVectors) {
+                restricted.push_back(x[r]);
+            }
+        }
+        if(ColumnsIndependent(&restricted, (int)rc.size(), (int)nullity, tol)) {
+            constraints->insert(it.first);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// After this system fails to converge, add the constraints that wrote
+// its unsatisfied equations to the list of bad constraints. The caller must
+// clear the constraint tags first; we tag the ones that we add, so that we
+// don't double-show constraints that generated multiple unsatisfied
+// equations.
+//-----------------------------------------------------------------------------
+void System::Matrix::FindUnsatisfied(List<hConstraint> *bad) {
+    // Not using range-for here because index is used in additional ways
+    for(int i = 0; i < m; i++) {
+        if(ffabs(B.num[i]) > CONVERGE_TOLERANCE || isnan(B.num[i])) {
+            // This constraint is unsatisfied.
+            if(!eq[i].isFromConstraint()) continue;
+
+            hConstraint hc = eq[i].constraint();
+            ConstraintBase *c = SK.constraint.FindByIdNoOops(hc);
+            if(!c) continue;
+            if(!c->tag) {
                 bad->Add(&(c->h));
+                c->tag = 1;
             }
         }
     }
 }
 
-SolveResult System::Solve(Group *g, int *rank, int *dof, List<hConstraint> *bad,
-                          bool andFindBad, bool andFindFree, bool forceDofCheck)
+//-----------------------------------------------------------------------------
+// Point a system that we wrote earlier back in to the param table, which may
+// have been rebuilt since. Every column of the systems that we keep is a
+// param that some equation reads, so we find them from the tape.
+//-----------------------------------------------------------------------------
+void System::Matrix::Rebind(IdList<Param,hParam> *table) {
+    B.sym.Rebind(table, &(SK.param));
+    B.batch.Rebind(B.sym);
+    std::fill(param.begin(), param.end(), (Param *)NULL);
+    for(const ExprTape::Instruction &i : B.sym.code) {
+        if(i.op == Expr::Op::PARAM_PTR && i.a >= 0) param[i.a] = i.p;
+    }
+    for(Param *p : param) {
+        ssassert(p != NULL, "Expected every column to be read by an equation");
+    }
+}
+
+// Doubles go in the keys by their bits, so that they compare exactly.
+static void WriteDoubleKey(double v, std::vector<uint64_t> *key) {
+    uint64_t b;
+    memcpy(&b, &v, sizeof(b));
+    key->push_back(b);
+}
+
+static void WriteParamKey(hParam hp, IdList<Param,hParam> *param, bool values,
+                          std::vector<uint64_t> *key)
 {
-    WriteEquationsExceptFor(Constraint::NO_CONSTRAINT, g);
+    key->push_back(hp.v);
+    Param *p = SK.param.FindByIdNoOops(hp);
+    if(!p) return;
+    // A known param from outside the system gets compiled as a constant.
+    bool outside = !param->FindByIdNoOops(hp);
+    if(outside) key->push_back(p->known);
+    if(values || (outside && p->known)) WriteDoubleKey(p->val, key);
+}
 
-    int i;
-    bool rankOk;
+static void WriteEntityKey(hEntity he, IdList<Param,hParam> *param, bool values,
+                           std::unordered_set<uint32_t> *seen,
+                           std::vector<uint64_t> *key)
+{
+    key->push_back(he.v);
+    if(!seen->insert(he.v).second) return;
+    EntityBase *e = SK.entity.FindByIdNoOops(he);
+    if(!e) return;
+
+    key->push_back((uint64_t)e->type);
+    key->push_back((uint64_t)e->extraPoints);
+    key->push_back((uint64_t)e->timesApplied);
+    for(double v : { e->numPoint.x, e->numPoint.y, e->numPoint.z,
+                     e->numNormal.w, e->numNormal.vx, e->numNormal.vy, e->numNormal.vz,
+                     e->numDistance, e->aspectRatio }) {
+        WriteDoubleKey(v, key);
+    }
+    for(hParam hp : e->param) {
+        WriteParamKey(hp, param, values, key);
+    }
+    for(hEntity hr : e->point) {
+        WriteEntityKey(hr, param, values, seen, key);
+    }
+    for(hEntity hr : { e->normal, e->distance, e->workplane }) {
+        WriteEntityKey(hr, param, values, seen, key);
+    }
+}
 
-/*
-    dbp("%d equations", eq.n);
-    for(i = 0; i < eq.n; i++) {
-        dbp("  %.3f = %s = 0", eq[i].e->Eval(), eq[i].e->Print());
+//-----------------------------------------------------------------------------
+// Write a key that's the same if the equations that we'd write for the group
+// would be the same, without writing them: the constraints, entities, and
+// params that they're written from, and anything else that decides them.
+// That's by the handles of what's referred to, and what it holds; except
+// that the values of the params that we solve for don't matter, apart from
+// the few places that they're read when the equations are written.
+//-----------------------------------------------------------------------------
+void System::WriteInputsKey(Group *g, bool forceDofCheck, std::vector<uint64_t> *key) {
+    key->clear();
+    key->push_back(forceDofCheck);
+    key->push_back(SK.group.Changes());
+    key->push_back(SK.request.Changes());
+    key->push_back(SK.constraint.Changes());
+    key->push_back(param.n);
+    for(const Param &p : param) {
+        key->push_back(p.h.v);
+    }
+    key->push_back(dragged.n);
+    for(const hParam &hp : dragged) {
+        key->push_back(hp.v);
     }
-    dbp("%d parameters", param.n);
-    for(i = 0; i < param.n; i++) {
-        dbp("   param %08x at %.3f", param[i].h.v, param[i].val);
-    } */
 
-    // All params and equations are assigned to group zero.
-    param.ClearTags();
-    eq.ClearTags();
+    std::unordered_set<uint32_t> seen;
+    key->push_back((uint64_t)g->type);
+    key->push_back(g->relaxConstraints);
+    key->push_back(g->allDimsReference);
+    for(hEntity he : { g->predef.origin, g->predef.entityB, g->predef.entityC }) {
+        WriteEntityKey(he, &param, /*values=*/false, &seen, key);
+    }
+
+    const std::vector<int> &constraints = SK.ItemsInGroup(g->h).constraint;
+    for(int i : constraints) {
+        ConstraintBase *c = &SK.constraint[i];
+        key->push_back(c->h.v);
+        key->push_back(c->reference);
+        // A reference dimension writes no equations, and its value changes
+        // as the others are solved.
+        if(c->reference) continue;
+
+        key->push_back((uint64_t)c->type);
+        key->push_back(c->other);
+        key->push_back(c->other2);
+        WriteDoubleKey(c->valA, key);
+        WriteParamKey(c->valP, &param, /*values=*/false, key);
+        WriteParamKey(c->valAParam, &param, /*values=*/false, key);
+        for(hEntity he : { c->workplane, c->ptA, c->ptB,
+                           c->entityA, c->entityB, c->entityC, c->entityD }) {
+            WriteEntityKey(he, &param, /*values=*/false, &seen, key);
+        }
+    }
+    for(auto &ent : SK.entity) {
+        if(ent.group != g->h) continue;
+        WriteEntityKey(ent.h, &param, /*values=*/false, &seen, key);
+    }
+
+    // And where things are, for the equations that are written from that.
+    std::unordered_set<uint32_t> seenValues;
+    auto writeValues = [&](hEntity he) {
+        WriteEntityKey(he, &param, /*values=*/true, &seenValues, key);
+    };
+    for(int i : constraints) {
+        ConstraintBase *c = &SK.constraint[i];
+        if(c->reference) continue;
+        switch(c->type) {
+            case Constraint::Type::WHERE_DRAGGED:
+                writeValues(c->ptA);
+                writeValues(c->workplane);
+                break;
+
+            case Constraint::Type::SAME_ORIENTATION:
+                writeValues(c->entityA);
+                writeValues(c->entityB);
+                break;
+
+            case Constraint::Type::EQUAL_LINE_ARC_LEN:
+                writeValues(c->entityB);
+                break;
+
+            case Constraint::Type::ANGLE:
+                WriteParamKey(c->valAParam, &param, /*values=*/true, key);
+                break;
+
+            default:
+                break;
+        }
+    }
+    if(g->type == Group::Type::ROTATE || g->type == Group::Type::REVOLVE ||
+       g->type == Group::Type::HELIX) {
+        writeValues(g->predef.entityB);
+    }
+}
 
+//-----------------------------------------------------------------------------
+// Write a key that's the same if the symbolic work to solve the group would
+// be the same: the params, the form of the equations, and anything else that
+// decides the substitutions, the systems, and how we compile them. The
+// constants in the equations don't decide any of that, so they're written
+// separately, and only the systems that they're in need compiling again
+// when they change.
+//-----------------------------------------------------------------------------
+static void WriteExprKey(const Expr *e, IdList<Param,hParam> *param,
+                         std::vector<uint64_t> *key, std::vector<uint64_t> *constant)
+{
+    key->push_back((uint64_t)e->op);
+    Param *p = NULL;
+    switch(e->op) {
+        case Expr::Op::PARAM:
+            key->push_back(e->parh.v);
+            if(!param->FindByIdNoOops(e->parh)) {
+                p = SK.param.FindByIdNoOops(e->parh);
+            }
+            break;
+
+        case Expr::Op::PARAM_PTR:
+            key->push_back(e->parp->h.v);
+            p = e->parp;
+            break;
+
+        case Expr::Op::CONSTANT:
+            WriteDoubleKey(e->v, constant);
+            break;
+
+        default:
+            if(e->Children() > 0) WriteExprKey(e->a, param, key, constant);
+            if(e->Children() > 1) WriteExprKey(e->b, param, key, constant);
+            break;
+    }
+    // A known param from outside the system gets compiled as a constant.
+    if(p) {
+        key->push_back(p->known);
+        if(p->known) WriteDoubleKey(p->val, constant);
+    }
+}
+
+void System::WriteStructureKey(bool forceDofCheck, std::vector<uint64_t> *key,
+                               std::vector<uint64_t> *constant,
+                               std::vector<int> *constantStart)
+{
+    key->clear();
+    constant->clear();
+    constantStart->clear();
+    key->push_back(forceDofCheck);
+    key->push_back(param.n);
+    for(const Param &p : param) {
+        key->push_back(p.h.v);
+    }
+    key->push_back(dragged.n);
+    for(const hParam &hp : dragged) {
+        key->push_back(hp.v);
+    }
+    key->push_back(eq.n);
+    for(const Equation &e : eq) {
+        key->push_back(e.h.v);
+        constantStart->push_back((int)constant->size());
+        WriteExprKey(e.e, &param, key, constant);
+    }
+    constantStart->push_back((int)constant->size());
+}
+
+//-----------------------------------------------------------------------------
+// Do the symbolic work to solve the group, which leaves the tags set, and
+// keep it to reuse.
+//-----------------------------------------------------------------------------
+void System::WriteStructure(Structure *st, bool forceDofCheck) {
     // Solving by substitution eliminates duplicate e.g. H/V constraints, which can cause rank test
     // to succeed even on overdefined systems, which will fail later.
     if(!forceDofCheck) {
         SolveBySubstitution();
     }
+    WriteEquationParams();
 
     // Before solving the big system, see if we can find any equations that
     // are soluble alone. This can be a huge speedup. We don't know whether
     // the system is consistent yet, but if it isn't then we'll catch that
     // later.
+    st->alone.clear();
     int alone = 1;
     for(auto &e : eq) {
         if(e.tag != 0)
             continue;
 
-        hParam hp = e.e->ReferencedParams(&param);
-        if(hp == Expr::NO_PARAMS) continue;
-        if(hp == Expr::MULTIPLE_PARAMS) continue;
+        if(e.params.size() != 1) continue;
 
-        Param *p = param.FindById(hp);
+        Param *p = &param[e.params[0]];
         if(p->tag != 0) continue; // let rank test catch inconsistency
 
         e.tag  = alone;
         p->tag = alone;
-        WriteJacobian(alone);
-        if(!NewtonSolve(alone)) {
-            // We don't do the rank test, so let's arbitrarily return
-            // the DIDNT_CONVERGE result here.
-            rankOk = true;
-            // Failed to converge, bail out early
-            goto didnt_converge;
-        }
+        st->alone.emplace_back();
+        WriteJacobian(alone, &st->alone.back());
         alone++;
     }
 
-    // Now write the Jacobian for what's left, and do a rank test; that
-    // tells us if the system is inconsistently constrained.
-    if(!WriteJacobian(0)) {
-        return SolveResult::TOO_MANY_UNKNOWNS;
+    // What's left usually falls apart into several independent systems, so
+    // solve each of those separately. That's faster, since each system takes
+    // only as many Newton steps as it needs, and one system that doesn't
+    // converge won't stop the others from converging.
+    int first = alone,
+        last  = TagComponents(first);
+
+    // The symbolic work allocates temporary memory, so we do that one system
+    // at a time; but then they can be solved in parallel.
+    st->systems.clear();
+    st->systems.resize(last - first);
+    for(int tag = first; tag < last; tag++) {
+        WriteJacobian(tag, &st->systems[tag - first]);
     }
 
-    rankOk = TestRank(rank);
+    st->paramTag.clear();
+    st->substd.clear();
+    for(const Param &p : param) {
+        st->paramTag.push_back(p.tag);
+        st->substd.push_back(p.substd);
+    }
+    st->eqTag.clear();
+    for(const Equation &e : eq) {
+        st->eqTag.push_back(e.tag);
+    }
+}
 
-    // And do the leftovers as one big system
-    if(!NewtonSolve(0)) {
-        goto didnt_converge;
+void System::ReuseStructure(Structure *st) {
+    for(int i = 0; i < param.n; i++) {
+        param[i].tag    = st->paramTag[i];
+        param[i].substd = st->substd[i];
+    }
+    for(int i = 0; i < eq.n; i++) {
+        eq[i].tag = st->eqTag[i];
     }
+    for(Matrix &sys : st->alone) {
+        sys.Rebind(&param);
+    }
+    for(Matrix &sys : st->systems) {
+        sys.Rebind(&param);
+    }
+}
 
-    rankOk = TestRank(rank);
-    if(!rankOk) {
-        if(andFindBad) FindWhichToRemoveToFixJacobian(g, bad, forceDofCheck);
+//-----------------------------------------------------------------------------
+// After ReuseStructure(), compile again those systems that have an equation
+// whose constants aren't the ones that they were compiled with. Folding a
+// constant that's become zero can leave a param that no equation reads, and
+// then the systems aren't the same after all; so returns false, with the
+// equations as they were, for the caller to write the structure afresh.
+//-----------------------------------------------------------------------------
+bool System::RecompileForConstants(Structure *st, const std::vector<uint64_t> &constant,
+                                   const std::vector<int> &constantStart)
+{
+    std::set<int> tags;
+    for(int i = 0; i < eq.n; i++) {
+        auto first = constant.begin() + constantStart[i],
+             last  = constant.begin() + constantStart[i + 1];
+        if(eq[i].tag > 0 && !std::equal(first, last, st->constant.begin() + constantStart[i])) {
+            tags.insert(eq[i].tag);
+        }
+    }
+    if(tags.empty()) return true;
+
+    // The equations of those systems, as substituted, but without touching
+    // the originals.
+    std::vector<Expr *> original;
+    for(auto &e : eq) {
+        original.push_back(e.e);
+        if(tags.count(e.tag)) {
+            e.e = e.e->DeepCopy();
+            SubstituteParams(e.e, &param);
+        }
+    }
+
+    bool ok = true;
+    int first = (int)st->alone.size() + 1;
+    for(int tag : tags) {
+        Matrix *sys = (tag < first) ? &st->alone[tag - 1] : &st->systems[tag - first];
+        WriteJacobian(tag, sys);
+        for(int j = 0; j < sys->n; j++) {
+            if(sys->A.colStart[j] == sys->A.colStart[j + 1]) ok = false;
+        }
+        stats.recompiled++;
+    }
+    for(int i = 0; i < eq.n; i++) {
+        eq[i].e = original[i];
+    }
+    return ok;
+}
+
+SolveResult System::Solve(Group *g, int *rank, int *dof, List<hConstraint> *bad,
+                          bool andFindBad, bool andFindFree, bool forceDofCheck)
+{
+    double start = Milliseconds();
+    stats = {};
+
+    bool rankOk;
+
+/*
+    dbp("%d equations", eq.n);
+    for(i = 0; i < eq.n; i++) {
+        dbp("  %.3f = %s = 0", eq[i].e->Eval(), eq[i].e->Print());
+    }
+    dbp("%d parameters", param.n);
+    for(i = 0; i < param.n; i++) {
+        dbp("   param %08x at %.3f", param[i].h.v, param[i].val);
+    } */
+
+    // The symbolic work depends only on the form of the equations, so if
+    // that's the same as when we last solved this group, then reuse it; and
+    // if nothing that they're written from has changed either, then we
+    // needn't even write them, just their handles. Finding the free params
+    // needs the equations as substituted, though, and when all dimensions
+    // are reference, writing the equations is what updates them.
+    Structure *st = &structure[g->h.v];
+    st->used = true;
+    std::vector<uint64_t> inputs;
+    WriteInputsKey(g, forceDofCheck, &inputs);
+    if(!andFindFree && !g->allDimsReference && inputs == st->inputs) {
+        for(hEquation he : st->eq) {
+            Equation e = {};
+            e.h = he;
+            eq.Add(&e);
+        }
+        // All params and equations are assigned to group zero.
+        param.ClearTags();
+        eq.ClearTags();
+        ReuseStructure(st);
+        stats.reused    = true;
+        stats.unchanged = true;
     } else {
-        // This is not the full Jacobian, but any substitutions or single-eq
-        // solves removed one equation and one unknown, therefore no effect
-        // on the number of DOF.
-        if(dof) *dof = CalculateDof();
-        MarkParamsFree(andFindFree);
+        WriteEquationsExceptFor(Constraint::NO_CONSTRAINT, g);
+        param.ClearTags();
+        eq.ClearTags();
+
+        std::vector<uint64_t> key, constant;
+        std::vector<int> constantStart;
+        WriteStructureKey(forceDofCheck, &key, &constant, &constantStart);
+        bool reuse = !andFindFree && key == st->key;
+        if(reuse) {
+            ReuseStructure(st);
+            if(!RecompileForConstants(st, constant, constantStart)) {
+                param.ClearTags();
+                eq.ClearTags();
+                reuse = false;
+            }
+        }
+        if(reuse) {
+            stats.reused = true;
+        } else {
+            stats.recompiled = 0;
+            WriteStructure(st, forceDofCheck);
+        }
+        st->inputs        = std::move(inputs);
+        st->key           = std::move(key);
+        st->constant      = std::move(constant);
+        st->constantStart = std::move(constantStart);
+        st->eq.clear();
+        for(const Equation &e : eq) {
+            st->eq.push_back(e.h);
+        }
+    }
+    stats.equations = eq.n;
+    stats.params    = param.n;
+
+    for(Matrix &sys : st->alone) {
+        sys.damped = g->dampedSolve;
+        sys.stats  = {};
     }
-    // System solved correctly, so write the new values back in to the
-    // main parameter table.
+    for(Matrix &sys : st->systems) {
+        sys.damped = g->dampedSolve;
+        sys.stats  = {};
+    }
+
+    bool converged = true;
+    // The params of anything that didn't converge, which stay where they
+    // were; and so do any params substituted by them.
+    std::unordered_set<uint32_t> unsolved;
+    for(Matrix &sys : st->alone) {
+        if(!sys.NewtonSolve()) {
+            // Leave the param where it was, and carry on with the others.
+            if(converged) SK.constraint.ClearTags();
+            converged = false;
+            sys.FindUnsatisfied(bad);
+            Param *p = sys.param[0];
+            p->val = SK.GetParam(p->h)->val;
+            unsolved.insert(p->h.v);
+        }
+    }
+
+    int first = (int)st->alone.size() + 1;
+    std::vector<Matrix> &systems = st->systems;
+    SolveInParallel(&systems);
+
+    rankOk = true;
+    int jacobianRank = 0;
+    for(Matrix &sys : systems) {
+        if(!sys.converged) {
+            if(converged) SK.constraint.ClearTags();
+            converged = false;
+            sys.FindUnsatisfied(bad);
+            // And leave this system where it was.
+            for(Param *p : sys.param) {
+                p->val = SK.GetParam(p->h)->val;
+                unsolved.insert(p->h.v);
+            }
+        }
+        rankOk = rankOk && sys.rankOk;
+        jacobianRank += sys.rank;
+    }
+    if(rank) *rank = jacobianRank;
+
     for(auto &p : param) {
+        if(p.tag == VAR_SUBSTITUTED) stats.substituted++;
+    }
+    stats.alone = (int)st->alone.size();
+    int mostIterations = -1;
+    auto addStats = [&](Matrix &sys) {
+        stats.iterations       += sys.stats.iterations;
+        stats.evalJacobianTime += sys.stats.evalJacobianTime;
+        stats.solveTime        += sys.stats.solveTime;
+        stats.rankTime         += sys.stats.rankTime;
+        if(sys.stats.iterations > mostIterations) {
+            mostIterations = sys.stats.iterations;
+            stats.residual = sys.stats.residual;
+        }
+    };
+    for(Matrix &sys : st->alone) {
+        addStats(sys);
+    }
+    for(Matrix &sys : systems) {
+        stats.systems.push_back(sys.m);
+        addStats(sys);
+    }
+
+    // The systems are all the leftovers, as far as the rank and DOF are
+    // concerned.
+    for(auto &p : param) {
+        if(p.tag >= first) p.tag = 0;
+    }
+    for(auto &e : eq) {
+        if(e.tag >= first) e.tag = 0;
+    }
+
+    if(converged) {
+        if(!rankOk) {
+            if(andFindBad) FindWhichToRemoveToFixJacobian(g, bad);
+        } else {
+            // This is not the full Jacobian, but any substitutions or single-eq
+            // solves removed one equation and one unknown, therefore no effect
+            // on the number of DOF.
+            if(dof) *dof = CalculateDof();
+            MarkParamsFree(andFindFree);
+        }
+    }
+    // Write the new values back in to the main parameter table; any system
+    // that didn't converge was left where it was, and so is anything
+    // substituted by one of its params.
+    for(auto &p : param) {
+        Param *pp = SK.GetParam(p.h);
         double val;
         if(p.tag == VAR_SUBSTITUTED) {
-            val = param.FindById(p.substd)->val;
+            if(unsolved.count(p.substd.v)) {
+                val = pp->val;
+            } else {
+                val = param.FindById(p.substd)->val;
+            }
         } else {
             val = p.val;
         }
-        Param *pp = SK.GetParam(p.h);
         pp->val = val;
         pp->known = true;
-        pp->free  = p.free;
+        if(converged) pp->free = p.free;
     }
-    return rankOk ? SolveResult::OKAY : SolveResult::REDUNDANT_OKAY;
-
-didnt_converge:
-    SK.constraint.ClearTags();
-    // Not using range-for here because index is used in additional ways
-    for(i = 0; i < eq.n; i++) {
-        if(ffabs(mat.B.num[i]) > CONVERGE_TOLERANCE || isnan(mat.B.num[i])) {
-            // This constraint is unsatisfied.
-            if(!mat.eq[i].isFromConstraint()) continue;
+    stats.totalTime = Milliseconds() - start;
 
-            hConstraint hc = mat.eq[i].constraint();
-            ConstraintBase *c = SK.constraint.FindByIdNoOops(hc);
-            if(!c) continue;
-            // Don't double-show constraints that generated multiple
-            // unsatisfied equations
-            if(!c->tag) {
-                bad->Add(&(c->h));
-                c->tag = 1;
-            }
-        }
+    if(converged) {
+        return rankOk ? SolveResult::OKAY : SolveResult::REDUNDANT_OKAY;
+    } else {
+        return rankOk ? SolveResult::DIDNT_CONVERGE : SolveResult::REDUNDANT_DIDNT_CONVERGE;
     }
-
-    return rankOk ? SolveResult::DIDNT_CONVERGE : SolveResult::REDUNDANT_DIDNT_CONVERGE;
 }
 
 SolveResult System::SolveRank(Group *g, int *rank, int *dof, List<hConstraint> *bad,
@@ -523,13 +1504,11 @@ SolveResult System::SolveRank(Group *g, int *rank, int *dof, List<hConstraint> *
 
     // Now write the Jacobian, and do a rank test; that
     // tells us if the system is inconsistently constrained.
-    if(!WriteJacobian(0)) {
-        return SolveResult::TOO_MANY_UNKNOWNS;
-    }
+    WriteJacobian(0, &mat);
 
-    bool rankOk = TestRank(rank);
+    bool rankOk = mat.TestRank(rank);
     if(!rankOk) {
-        if(andFindBad) FindWhichToRemoveToFixJacobian(g, bad, /*forceDofCheck=*/true);
+        if(andFindBad) FindWhichToRemoveToFixJacobian(g, bad);
     } else {
         if(dof) *dof = CalculateDof();
         MarkParamsFree(andFindFree);
@@ -537,36 +1516,75 @@ SolveResult System::SolveRank(Group *g, int *rank, int *dof, List<hConstraint> *
     return rankOk ? SolveResult::OKAY : SolveResult::REDUNDANT_OKAY;
 }
 
+//-----------------------------------------------------------------------------
+// Forget the structure of every group that we haven't solved since we were
+// last called, so that we keep what's being solved now, and not everything
+// that ever was. If we haven't solved anything, then there's nothing to go
+// by, so we keep it all.
+//-----------------------------------------------------------------------------
+void System::ForgetUnusedStructures() {
+    bool anyUsed = false;
+    for(auto &it : structure) {
+        if(it.second.used) anyUsed = true;
+    }
+    if(!anyUsed) return;
+
+    for(auto it = structure.begin(); it != structure.end();) {
+        if(it->second.used) {
+            it->second.used = false;
+            ++it;
+        } else {
+            it = structure.erase(it);
+        }
+    }
+}
+
 void System::Clear() {
     entity.Clear();
     param.Clear();
     eq.Clear();
     dragged.Clear();
+    structure.clear();
 }
 
 void System::MarkParamsFree(bool find) {
-    // If requested, find all the free (unbound) variables. This might be
-    // more than the number of degrees of freedom. Don't always do this,
-    // because the display would get annoying and it's slow.
     for(auto &p : param) {
         p.free = false;
-
-        if(find) {
-            if(p.tag == 0) {
-                p.tag = VAR_DOF_TEST;
-                WriteJacobian(0);
-                EvalJacobian();
-                int rank = CalculateRank();
-                if(rank == mat.m) {
-                    p.free = true;
-                }
-                p.tag = 0;
-            }
+    }
+    // If requested, find all the free (unbound) variables. This might be
+    // more than the number of degrees of freedom. Don't always do this,
+    // because the display would get annoying.
+    if(!find) return;
+
+    // A param is free if the equations keep full rank without its column a
+    // of the Jacobian. The part of that param's unit vector that lies in the
+    // span of the equations is a'*(A*A')^-1*a, which is one if it's bound,
+    // and that needs only the one factorization.
+    WriteJacobian(0, &mat);
+    mat.EvalJacobian();
+    mat.CalculateRank();
+
+    std::vector<double> work(mat.m, 0.0);
+    std::vector<SparseSymmetricMatrix::Entry> a;
+    for(int j = 0; j < mat.n; j++) {
+        a.clear();
+        for(int kc = mat.A.colStart[j]; kc < mat.A.colStart[j + 1]; kc++) {
+            a.push_back({ mat.A.colRow[kc], mat.A.num[mat.A.colEntry[kc]] });
+        }
+        if(mat.AAt.InverseQuadratic(a, work.data()) < 1.0 - RANK_MAG_TOLERANCE) {
+            mat.param[j]->free = true;
         }
     }
 }
 
 int System::CalculateDof() {
-    return mat.n - mat.m;
+    int n = 0, m = 0;
+    for(auto &p : param) {
+        if(p.tag == 0) n++;
+    }
+    for(auto &e : eq) {
+        if(e.tag == 0) m++;
+    }
+    return n - m;
 }
 
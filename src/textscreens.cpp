@@ -226,6 +226,8 @@ void TextWindow::ScreenChangeGroupOption(int link, uint32_t v) {
 
         case 'e': g->allowRedundant = !(g->allowRedundant); break;
 
+        case 'm': g->dampedSolve = !(g->dampedSolve); break;
+
         case 'v': g->visible = !(g->visible); break;
 
         case 'd': g->allDimsReference = !(g->allDimsReference); break;
@@ -434,6 +436,10 @@ void TextWindow::ShowGroupInfo() {
         &TextWindow::ScreenChangeGroupOption,
         g->allowRedundant ? CHECK_TRUE : CHECK_FALSE);
 
+    Printf(false, " %f%Lm%Fd%s  damp solver steps (for hard drags)",
+        &TextWindow::ScreenChangeGroupOption,
+        g->dampedSolve ? CHECK_TRUE : CHECK_FALSE);
+
     Printf(false, " %f%Ld%Fd%s  treat all dimensions as reference",
         &TextWindow::ScreenChangeGroupOption,
         g->allDimsReference ? CHECK_TRUE : CHECK_FALSE);
@@ -483,6 +489,35 @@ list_items:
         }
     }
     if(a == 0) Printf(false, "%Ba   (none)");
+
+    if(shown.group == Group::HGROUP_REFERENCES) return;
+
+    const SolveStats &st = g->solved.stats;
+    int largest = 0;
+    for(int m : st.systems) {
+        largest = max(largest, m);
+    }
+    Printf(false, "");
+    Printf(false, "%Ft solver statistics (last solve)");
+    Printf(false, "%Ba   %d equations in %d params, %d substituted",
+           st.equations, st.params, st.substituted);
+    Printf(false, "%Bd   %d solved alone, %d system%s (largest %d)",
+           st.alone, (int)st.systems.size(),
+           st.systems.size() == 1 ? "" : "s", largest);
+    if(!st.residual.empty()) {
+        Printf(false, "%Ba   %d Newton steps, residual %s to %s",
+               st.iterations,
+               ssprintf("%.1e", st.residual.front()).c_str(),
+               ssprintf("%.1e", st.residual.back()).c_str());
+    } else {
+        Printf(false, "%Ba   %d Newton steps", st.iterations);
+    }
+    Printf(false, "%Bd   Jacobian %@ ms to write%s, %@ ms to evaluate",
+           st.writeJacobianTime, st.reused ? " (reused)" : "",
+           st.evalJacobianTime);
+    Printf(false, "%Ba   %@ ms in least squares, %@ ms in rank tests",
+           st.solveTime, st.rankTime);
+    Printf(false, "%Bd   %@ ms in all", st.totalTime);
 }
 
 //-----------------------------------------------------------------------------
@@ -526,10 +561,6 @@ void TextWindow::ShowGroupSolveInfo() {
             Printf(true, "remove any one of these to fix it");
             break;
 
-        case SolveResult::TOO_MANY_UNKNOWNS:
-            Printf(true, "Too many unknowns in a single group!");
-            return;
-
         default: ssassert(false, "Unexpected solve result");
     }
 
@@ -15,7 +15,7 @@ void SolveSpaceUI::UndoRemember() {
 }
 
 void SolveSpaceUI::UndoUndo() {
-    if(undo.cnt <= 0) return;
+    if(undo.empty()) return;
 
     PushFromCurrentOnto(&redo);
     PopOntoCurrentFrom(&undo);
@@ -23,7 +23,7 @@ void SolveSpaceUI::UndoUndo() {
 }
 
 void SolveSpaceUI::UndoRedo() {
-    if(redo.cnt <= 0) return;
+    if(redo.empty()) return;
 
     PushFromCurrentOnto(&undo);
     PopOntoCurrentFrom(&redo);
@@ -31,70 +31,261 @@ void SolveSpaceUI::UndoRedo() {
 }
 
 void SolveSpaceUI::UndoEnableMenus() {
-    SS.GW.undoMenuItem->SetEnabled(undo.cnt > 0);
-    SS.GW.redoMenuItem->SetEnabled(redo.cnt > 0);
+    if(!SS.GW.window) return;
+
+    SS.GW.undoMenuItem->SetEnabled(!undo.empty());
+    SS.GW.redoMenuItem->SetEnabled(!redo.empty());
 }
 
-void SolveSpaceUI::PushFromCurrentOnto(UndoStack *uk) {
-    if(uk->cnt == MAX_UNDO) {
-        UndoClearState(&(uk->d[uk->write]));
-        // And then write in to this one again
-    } else {
-        (uk->cnt)++;
+//-----------------------------------------------------------------------------
+// Whether an item has changed since it was remembered, in anything that we
+// restore on undo; and roughly how much memory a copy of it takes.
+//-----------------------------------------------------------------------------
+static bool SameRemap(const EntityMap &a, const EntityMap &b) {
+    if(a.size() != b.size()) return false;
+    for(const auto &kv : a) {
+        auto it = b.find(kv.first);
+        if(it == b.end() || it->second.v != kv.second.v) return false;
     }
+    return true;
+}
+static bool SameForUndo(const Group &a, const Group &b) {
+    return a.h == b.h && a.type == b.type && a.order == b.order &&
+        a.opA == b.opA && a.opB == b.opB && a.visible == b.visible &&
+        a.suppress == b.suppress && a.relaxConstraints == b.relaxConstraints &&
+        a.allowRedundant == b.allowRedundant && a.dampedSolve == b.dampedSolve &&
+        a.allDimsReference == b.allDimsReference && a.scale == b.scale &&
+        a.activeWorkplane == b.activeWorkplane &&
+        a.valA == b.valA && a.valB == b.valB && a.valC == b.valC &&
+        a.color.Equals(b.color) && a.subtype == b.subtype &&
+        a.skipFirst == b.skipFirst &&
+        a.predef.q.w == b.predef.q.w && a.predef.q.vx == b.predef.q.vx &&
+        a.predef.q.vy == b.predef.q.vy && a.predef.q.vz == b.predef.q.vz &&
+        a.predef.origin == b.predef.origin && a.predef.entityB == b.predef.entityB &&
+        a.predef.entityC == b.predef.entityC && a.predef.swapUV == b.predef.swapUV &&
+        a.predef.negateU == b.predef.negateU && a.predef.negateV == b.predef.negateV &&
+        a.meshCombine == b.meshCombine && a.forceToMesh == b.forceToMesh &&
+        a.linkFile.raw == b.linkFile.raw && a.name == b.name &&
+        SameRemap(a.remap, b.remap);
+}
+static bool SameForUndo(const Request &a, const Request &b) {
+    return a.h == b.h && a.type == b.type && a.extraPoints == b.extraPoints &&
+        a.workplane == b.workplane && a.group == b.group && a.style == b.style &&
+        a.construction == b.construction && a.str == b.str && a.font == b.font &&
+        a.file.raw == b.file.raw && a.aspectRatio == b.aspectRatio;
+}
+static bool SameForUndo(const Constraint &a, const Constraint &b) {
+    return a.h == b.h && a.Equals(b) &&
+        a.disp.offset.EqualsExactly(b.disp.offset) && a.disp.style == b.disp.style;
+}
+static bool SameForUndo(const Style &a, const Style &b) {
+    return a.h == b.h && a.name == b.name &&
+        a.width == b.width && a.widthAs == b.widthAs &&
+        a.textHeight == b.textHeight && a.textHeightAs == b.textHeightAs &&
+        a.textOrigin == b.textOrigin && a.textAngle == b.textAngle &&
+        a.color.Equals(b.color) && a.filled == b.filled &&
+        a.fillColor.Equals(b.fillColor) && a.visible == b.visible &&
+        a.exportable == b.exportable && a.stippleType == b.stippleType &&
+        a.stippleScale == b.stippleScale && a.zIndex == b.zIndex;
+}
+static bool SameForUndo(const Param &a, const Param &b) {
+    return a.h == b.h && a.val == b.val && a.known == b.known &&
+        a.free == b.free && a.substd == b.substd;
+}
+
+static size_t BytesForUndo(const Group &g) {
+    // Each entry of the map is a node of its own, with a couple of pointers.
+    return sizeof(g) + g.name.capacity() + g.linkFile.raw.capacity() +
+        g.remap.size() * (sizeof(EntityMap::value_type) + 2 * sizeof(void *));
+}
+static size_t BytesForUndo(const Request &r) {
+    return sizeof(r) + r.str.capacity() + r.font.capacity() + r.file.raw.capacity();
+}
+static size_t BytesForUndo(const Constraint &c) {
+    return sizeof(c) + c.comment.capacity();
+}
+static size_t BytesForUndo(const Style &s) {
+    return sizeof(s) + s.name.capacity();
+}
+static size_t BytesForUndo(const std::vector<Param> &pv) {
+    return sizeof(pv) + pv.capacity() * sizeof(Param);
+}
+static size_t BytesForUndo(const std::vector<hGroup> &order) {
+    return sizeof(order) + order.capacity() * sizeof(hGroup);
+}
+template<class T>
+static size_t BytesForUndo(const SolveSpaceUI::UndoItems<T> &items) {
+    return sizeof(items) + items.capacity() * sizeof(std::shared_ptr<const T>);
+}
+
+// The copy that we remember, without anything that gets regenerated.
+template<class T>
+static T CopyForUndo(const T &src) {
+    return src;
+}
+static Group CopyForUndo(const Group &src) {
+    // Shallow copy
+    Group dest(src);
+    // And then clean up all the stuff that needs to be a deep copy,
+    // and zero out all the dynamic stuff that will get regenerated.
+    dest.clean = false;
+    dest.solved = {};
+    dest.polyLoops = {};
+    dest.bezierLoops = {};
+    dest.bezierOpens = {};
+    dest.polyError = {};
+    dest.thisMesh = {};
+    dest.runningMesh = {};
+    dest.thisShell = {};
+    dest.runningShell = {};
+    dest.displayMesh = {};
+    dest.displayOutlines = {};
+
+    dest.remap = src.remap;
+
+    dest.impMesh = {};
+    dest.impShell = {};
+    dest.impEntity = {};
+    return dest;
+}
+
+// Make a copy to be shared between undo states, counted in SS.undoBytes for
+// as long as any of them holds it.
+template<class T>
+static std::shared_ptr<const T> ShareForUndo(T &&item) {
+    size_t bytes = BytesForUndo(item);
+    SS.undoBytes += bytes;
+    return std::shared_ptr<const T>(new T(std::move(item)), [bytes](const T *t) {
+        SS.undoBytes -= bytes;
+        delete t;
+    });
+}
 
-    UndoState *ut = &(uk->d[uk->write]);
-    *ut = {};
-    ut->group.ReserveMore(SK.group.n);
-    for(Group &src : SK.group) {
-        // Shallow copy
-        Group dest(src);
-        // And then clean up all the stuff that needs to be a deep copy,
-        // and zero out all the dynamic stuff that will get regenerated.
-        dest.clean = false;
-        dest.solved = {};
-        dest.polyLoops = {};
-        dest.bezierLoops = {};
-        dest.bezierOpens = {};
-        dest.polyError = {};
-        dest.thisMesh = {};
-        dest.runningMesh = {};
-        dest.thisShell = {};
-        dest.runningShell = {};
-        dest.displayMesh = {};
-        dest.displayOutlines = {};
-
-        dest.remap = src.remap;
-
-        dest.impMesh = {};
-        dest.impShell = {};
-        dest.impEntity = {};
-        ut->group.Add(&dest);
+// The list that we remember, shared with one of the previous states if
+// it's the same as theirs, item for item.
+template<class T>
+static std::shared_ptr<const T> ShareListForUndo(T &&items,
+                                                 const std::vector<std::shared_ptr<const T>> &prev) {
+    for(const std::shared_ptr<const T> &pv : prev) {
+        if(*pv == items) return pv;
     }
-    for(auto &src : SK.groupOrder) { ut->groupOrder.Add(&src); }
-    ut->request.ReserveMore(SK.request.n);
-    for(auto &src : SK.request) { ut->request.Add(&src); }
-    ut->constraint.ReserveMore(SK.constraint.n);
-    for(auto &src : SK.constraint) {
-        // Shallow copy
-        Constraint dest(src);
-        ut->constraint.Add(&dest);
+    return ShareForUndo(std::move(items));
+}
+
+//-----------------------------------------------------------------------------
+// Remember the items in a list, in order of handle. Anything that's the same
+// as in one of the previous states, which are also in order of handle, is
+// shared with it instead of being copied again. We still compare every item,
+// since they're changed in place, without anything to tell us which.
+//-----------------------------------------------------------------------------
+template<class T, class H>
+static SolveSpaceUI::UndoList<T> RememberItems(IdList<T,H> *list,
+                                               const std::vector<SolveSpaceUI::UndoList<T>> &prev) {
+    SolveSpaceUI::UndoItems<T> items;
+    std::vector<size_t> at(prev.size(), 0);
+    items.reserve(list->n);
+    for(const T &t : *list) {
+        std::shared_ptr<const T> same;
+        for(size_t k = 0; k < prev.size() && !same; k++) {
+            const SolveSpaceUI::UndoItems<T> &pv = *prev[k];
+            while(at[k] < pv.size() && pv[at[k]]->h.v < t.h.v) at[k]++;
+            if(at[k] < pv.size() && SameForUndo(*pv[at[k]], t)) {
+                same = pv[at[k]];
+            }
+        }
+        if(!same) same = ShareForUndo(CopyForUndo(t));
+        items.push_back(std::move(same));
+    }
+    return ShareListForUndo(std::move(items), prev);
+}
+
+// There are many more params than anything else, so they're remembered the
+// same way but in runs, one for each request, constraint or group that they
+// came from; which are the params with the same top half of their handles.
+static SolveSpaceUI::UndoList<std::vector<Param>> RememberParams(
+        IdList<Param,hParam> *list,
+        const std::vector<SolveSpaceUI::UndoList<std::vector<Param>>> &prev) {
+    SolveSpaceUI::UndoItems<std::vector<Param>> items;
+    std::vector<size_t> at(prev.size(), 0);
+    for(int i = 0, j; i < list->n; i = j) {
+        uint32_t top = list->Get(i).h.v >> 16;
+        for(j = i + 1; j < list->n && (list->Get(j).h.v >> 16) == top; j++) {}
+        const Param *run = &list->Get(i);
+        size_t n = (size_t)(j - i);
+
+        std::shared_ptr<const std::vector<Param>> same;
+        for(size_t k = 0; k < prev.size() && !same; k++) {
+            const SolveSpaceUI::UndoItems<std::vector<Param>> &pv = *prev[k];
+            while(at[k] < pv.size() && ((*pv[at[k]])[0].h.v >> 16) < top) at[k]++;
+            if(at[k] < pv.size() && pv[at[k]]->size() == n &&
+               std::equal(run, run + n, pv[at[k]]->begin(),
+                          [](const Param &a, const Param &b) { return SameForUndo(a, b); }))
+            {
+                same = pv[at[k]];
+            }
+        }
+        if(!same) same = ShareForUndo(std::vector<Param>(run, run + n));
+        items.push_back(std::move(same));
+    }
+    items.shrink_to_fit();
+    return ShareListForUndo(std::move(items), prev);
+}
+
+template<class T, class H>
+static void RestoreItems(const SolveSpaceUI::UndoItems<T> &items, IdList<T,H> *list) {
+    list->ReserveMore((int)items.size());
+    for(const std::shared_ptr<const T> &item : items) {
+        list->Add(item.get());
+    }
+}
+
+void SolveSpaceUI::PushFromCurrentOnto(UndoStack *uk) {
+    // The state that we're most likely to be remembering again is the last
+    // one pushed on either stack.
+    std::vector<const UndoState *> prev;
+    if(!undo.empty()) prev.push_back(&undo.back());
+    if(!redo.empty()) prev.push_back(&redo.back());
+
+    std::vector<UndoList<Group>>                pg;
+    std::vector<std::shared_ptr<const std::vector<hGroup>>> po;
+    std::vector<UndoList<Request>>              pr;
+    std::vector<UndoList<Constraint>>           pc;
+    std::vector<UndoList<std::vector<Param>>>   pp;
+    std::vector<UndoList<Style>>                ps;
+    for(const UndoState *p : prev) {
+        pg.push_back(p->group);
+        po.push_back(p->groupOrder);
+        pr.push_back(p->request);
+        pc.push_back(p->constraint);
+        pp.push_back(p->param);
+        ps.push_back(p->style);
     }
-    ut->param.ReserveMore(SK.param.n);
-    for(auto &src : SK.param) { ut->param.Add(&src); }
-    ut->style.ReserveMore(SK.style.n);
-    for(auto &src : SK.style) { ut->style.Add(&src); }
-    ut->activeGroup = SS.GW.activeGroup;
 
-    uk->write = WRAP(uk->write + 1, MAX_UNDO);
+    UndoState ut = {};
+    ut.group      = RememberItems(&SK.group, pg);
+    ut.request    = RememberItems(&SK.request, pr);
+    ut.constraint = RememberItems(&SK.constraint, pc);
+    ut.param      = RememberParams(&SK.param, pp);
+    ut.style      = RememberItems(&SK.style, ps);
+    std::vector<hGroup> groupOrder;
+    for(hGroup hg : SK.groupOrder) { groupOrder.push_back(hg); }
+    ut.groupOrder = ShareListForUndo(std::move(groupOrder), po);
+    ut.activeGroup = SS.GW.activeGroup;
+    uk->push_back(std::move(ut));
+
+    // And forget the oldest states, until everything fits in our budget;
+    // but always keep at least one, however big.
+    while(undoBytes + (undo.size() + redo.size()) * sizeof(UndoState) >
+              (size_t)UNDO_MEMORY_LIMIT && undo.size() > 1) {
+        undo.pop_front();
+    }
 }
 
 void SolveSpaceUI::PopOntoCurrentFrom(UndoStack *uk) {
-    ssassert(uk->cnt > 0, "Cannot pop from empty undo stack");
-    (uk->cnt)--;
-    uk->write = WRAP(uk->write - 1, MAX_UNDO);
+    ssassert(!uk->empty(), "Cannot pop from empty undo stack");
 
-    UndoState *ut = &(uk->d[uk->write]);
+    UndoState ut = std::move(uk->back());
+    uk->pop_back();
 
     // Free everything in the main copy of the program before replacing it
     for(hGroup hg : SK.groupOrder) {
@@ -108,17 +299,17 @@ void SolveSpaceUI::PopOntoCurrentFrom(UndoStack *uk) {
     SK.param.Clear();
     SK.style.Clear();
 
-    // And then do a shallow copy of the state from the undo list
-    ut->group.MoveSelfInto(&(SK.group));
-    for(auto &gh : ut->groupOrder) { SK.groupOrder.Add(&gh); }
-    ut->request.MoveSelfInto(&(SK.request));
-    ut->constraint.MoveSelfInto(&(SK.constraint));
-    ut->param.MoveSelfInto(&(SK.param));
-    ut->style.MoveSelfInto(&(SK.style));
-    SS.GW.activeGroup = ut->activeGroup;
-
-    // No need to free it, since a shallow copy was made above
-    *ut = {};
+    // And then copy the state from the undo list; it's still shared with the
+    // other states, so those items can't be moved.
+    RestoreItems(*ut.group, &(SK.group));
+    for(hGroup hg : *ut.groupOrder) { SK.groupOrder.Add(&hg); }
+    RestoreItems(*ut.request, &(SK.request));
+    RestoreItems(*ut.constraint, &(SK.constraint));
+    for(const std::shared_ptr<const std::vector<Param>> &run : *ut.param) {
+        for(const Param &p : *run) { SK.param.Add(&p); }
+    }
+    RestoreItems(*ut.style, &(SK.style));
+    SS.GW.activeGroup = ut.activeGroup;
 
     // And reset the state everywhere else in the program, since the
     // sketch just changed a lot.
@@ -134,21 +325,6 @@ void SolveSpaceUI::PopOntoCurrentFrom(UndoStack *uk) {
 }
 
 void SolveSpaceUI::UndoClearStack(UndoStack *uk) {
-    while(uk->cnt > 0) {
-        uk->write = WRAP(uk->write - 1, MAX_UNDO);
-        (uk->cnt)--;
-        UndoClearState(&(uk->d[uk->write]));
-    }
-    *uk = {}; // for good measure
+    // Which frees any items that aren't shared with the other stack.
+    uk->clear();
 }
-
-void SolveSpaceUI::UndoClearState(UndoState *ut) {
-    for(auto &g : ut->group) { g.remap.clear(); }
-    ut->group.Clear();
-    ut->request.Clear();
-    ut->constraint.Clear();
-    ut->param.Clear();
-    ut->style.Clear();
-    *ut = {};
-}
-
@@ -99,6 +99,98 @@ void SolveSpace::MultMatrix(double *mata, double *matb, double *matr) {
     }
 }
 
+//-----------------------------------------------------------------------------
+// The temporary heap, on which we allocate expressions and other things that
+// get freed all at once, after every regeneration of the model. It's an
+// arena of large chunks, so an allocation is just a bump of a pointer; and
+// freeing back to a mark, like at the end of a TemporaryScope, just moves
+// the pointer back. Each thread has its own, so that the library can solve
+// on several at once.
+//-----------------------------------------------------------------------------
+namespace SolveSpace {
+
+static const size_t TEMP_CHUNK_SIZE = 1 << 20;
+
+class TempArena {
+public:
+    struct Chunk {
+        char    *mem;
+        size_t  size;
+    };
+    // The chunks in use are [0, current]; we keep one more after those,
+    // so that a loop that marks and frees doesn't allocate every time.
+    std::vector<Chunk>  chunks;
+    size_t              current;
+    size_t              used;
+
+    void FreeChunksAfter(size_t i) {
+        for(size_t j = i + 1; j < chunks.size(); j++) {
+            free(chunks[j].mem);
+        }
+        if(chunks.size() > i + 1) chunks.resize(i + 1);
+    }
+
+    ~TempArena() {
+        for(Chunk &c : chunks) {
+            free(c.mem);
+        }
+    }
+};
+
+static thread_local TempArena Arena = {};
+
+}
+
+void *SolveSpace::AllocTemporary(size_t n) {
+    // Keep everything aligned for any type.
+    const size_t align = alignof(max_align_t);
+    n = (n + align - 1) & ~(align - 1);
+
+    TempArena *a = &Arena;
+    if(a->chunks.empty() || a->used + n > a->chunks[a->current].size) {
+        size_t next = a->chunks.empty() ? 0 : a->current + 1;
+        if(next < a->chunks.size() && a->chunks[next].size < n) {
+            a->FreeChunksAfter(next - 1);
+        }
+        if(next == a->chunks.size()) {
+            TempArena::Chunk c;
+            c.size = max(n, TEMP_CHUNK_SIZE);
+            c.mem  = (char *)malloc(c.size);
+            ssassert(c.mem != NULL, "Cannot allocate memory");
+            a->chunks.push_back(c);
+        }
+        a->current = next;
+        a->used    = 0;
+    }
+
+    void *v = a->chunks[a->current].mem + a->used;
+    a->used += n;
+    memset(v, 0, n);
+    return v;
+}
+
+void SolveSpace::FreeAllTemporary() {
+    TempArena *a = &Arena;
+    a->current = 0;
+    a->used    = 0;
+    a->FreeChunksAfter(1);
+}
+
+SolveSpace::TemporaryScope::TemporaryScope() {
+    chunk = Arena.current;
+    used  = Arena.used;
+}
+
+SolveSpace::TemporaryScope::~TemporaryScope() {
+    TempArena *a = &Arena;
+    // If everything was freed in the meantime, then there's nothing left
+    // to do.
+    if(chunk > a->current || (chunk == a->current && used > a->used)) return;
+    a->current = chunk;
+    a->used    = used;
+    a->FreeChunksAfter(chunk + 1);
+}
+
 //-----------------------------------------------------------------------------
 // Format the string for our message box appropriately, and then display
 // that string.
@@ -240,6 +332,186 @@ void BandedMatrix::Solve() {
     }
 }
 
+//-----------------------------------------------------------------------------
+// Factor a sparse symmetric matrix as L*D*L'. The pivots are chosen in order
+// of minimum degree, which keeps the fill-in small; no pivoting is required
+// for numerical reasons, since the matrix is positive semidefinite. A pivot
+// whose magnitude is not above tol corresponds to a row that's linearly
+// dependent on the rows already eliminated; we skip it, and don't use it to
+// eliminate anything else. Returns the number of pivots that we did use,
+// which is the rank of the matrix.
+//-----------------------------------------------------------------------------
+void SparseSymmetricMatrix::Clear(int size) {
+    n = size;
+    diag.assign(n, 0.0);
+    row.clear();
+    row.resize(n);
+    order.clear();
+    d.clear();
+    l.clear();
+}
+
+int SparseSymmetricMatrix::Factor(double tol) {
+    int rank = 0;
+    order.clear();
+    pivot.assign(n, -1);
+    d.clear();
+    l.clear();
+    order.reserve(n);
+    d.reserve(n);
+    l.reserve(n);
+
+    // Candidate pivots by degree; entries go stale as degrees change, and
+    // are discarded when popped. Ties go to the lowest index, so that the
+    // result is deterministic.
+    typedef std::pair<int, int> DegreeIndex;
+    std::priority_queue<DegreeIndex, std::vector<DegreeIndex>,
+                        std::greater<DegreeIndex>> queue;
+    std::vector<bool> done(n, false);
+    for(int i = 0; i < n; i++) {
+        queue.push({ (int)row[i].size(), i });
+    }
+
+    std::vector<Entry> merged;
+    while(!queue.empty()) {
+        DegreeIndex di = queue.top();
+        queue.pop();
+        int k = di.second;
+        if(done[k] || di.first != (int)row[k].size()) continue;
+        done[k] = true;
+
+        std::vector<Entry> &rk = row[k];
+        pivot[k] = (int)order.size();
+        double dk = diag[k];
+        bool use = (dk > tol);
+        order.push_back(k);
+        d.push_back(use ? dk : 0.0);
+        l.emplace_back();
+        if(use) {
+            rank++;
+            std::vector<Entry> &lk = l.back();
+            lk.reserve(rk.size());
+            for(const Entry &e : rk) {
+                lk.push_back({ e.col, e.v / dk });
+            }
+        }
+
+        // Eliminate this pivot from the rows of its neighbours, which
+        // become the Schur complement; or if the pivot is unusable, then
+        // just drop it from the matrix.
+        for(const Entry &ei : rk) {
+            int i = ei.col;
+            std::vector<Entry> &ri = row[i];
+            merged.clear();
+            if(use) {
+                double s = ei.v / dk;
+                diag[i] -= s*ei.v;
+                auto a = ri.begin();
+                auto b = rk.begin();
+                while(a != ri.end() || b != rk.end()) {
+                    if(b == rk.end() || (a != ri.end() && a->col < b->col)) {
+                        if(a->col != k) merged.push_back(*a);
+                        ++a;
+                    } else if(a == ri.end() || b->col < a->col) {
+                        if(b->col != i) merged.push_back({ b->col, -s*b->v });
+                        ++b;
+                    } else {
+                        merged.push_back({ a->col, a->v - s*b->v });
+                        ++a;
+                        ++b;
+                    }
+                }
+            } else {
+                for(const Entry &e : ri) {
+                    if(e.col != k) merged.push_back(e);
+                }
+            }
+            ri.swap(merged);
+            queue.push({ (int)ri.size(), i });
+        }
+        rk.clear();
+    }
+    return rank;
+}
+
+void SparseSymmetricMatrix::Solve(double *x) const {
+    int i, k;
+    // Forward substitution with L, and divide by D ...
+    for(i = 0; i < (int)order.size(); i++) {
+        k = order[i];
+        double xk = x[k];
+        for(const Entry &e : l[i]) {
+            x[e.col] -= e.v*xk;
+        }
+    }
+    for(i = 0; i < (int)order.size(); i++) {
+        k = order[i];
+        x[k] = (d[i] == 0.0) ? 0.0 : x[k] / d[i];
+    }
+    // ... then back-substitution with L'.
+    for(i = (int)order.size() - 1; i >= 0; i--) {
+        k = order[i];
+        double xk = x[k];
+        for(const Entry &e : l[i]) {
+            xk -= e.v*x[e.col];
+        }
+        x[k] = xk;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// For the i-th pivot, which Factor() skipped, find the null vector x with
+// x[order[i]] = 1, in terms of the pivots before it. That's the solution of
+// L'*x = e, and since D is zero for that pivot, it's in the nullspace.
+//-----------------------------------------------------------------------------
+void SparseSymmetricMatrix::NullVector(int i, double *x) const {
+    std::fill(x, x + n, 0.0);
+    x[order[i]] = 1.0;
+    for(int j = i - 1; j >= 0; j--) {
+        double xk = 0.0;
+        for(const Entry &e : l[j]) {
+            xk -= e.v*x[e.col];
+        }
+        x[order[j]] = xk;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Find b'*A^-1*b for a sparse vector b, from the factorization; the skipped
+// pivots are left out, as in Solve(). The forward substitution with L only
+// visits the pivots that b reaches, so the work array (of n zeros, and left
+// that way) is never scanned.
+//-----------------------------------------------------------------------------
+double SparseSymmetricMatrix::InverseQuadratic(const std::vector<Entry> &b,
+                                               double *work) const
+{
+    std::priority_queue<int, std::vector<int>, std::greater<int>> reached;
+    for(const Entry &e : b) {
+        work[e.col] += e.v;
+        reached.push(pivot[e.col]);
+    }
+
+    double sum = 0.0;
+    int last = -1;
+    while(!reached.empty()) {
+        int i = reached.top();
+        reached.pop();
+        if(i == last) continue;
+        last = i;
+
+        int k = order[i];
+        double xk = work[k];
+        work[k] = 0.0;
+        if(d[i] == 0.0) continue;
+        sum += xk*xk / d[i];
+        for(const Entry &e : l[i]) {
+            work[e.col] -= e.v*xk;
+            reached.push(pivot[e.col]);
+        }
+    }
+    return sum;
+}
+
 const Quaternion Quaternion::IDENTITY = { 1, 0, 0, 0 };
 
 Quaternion Quaternion::From(double w, double vx, double vy, double vz) {
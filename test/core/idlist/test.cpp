@@ -0,0 +1,220 @@
+#include "harness.h"
+#include <random>
+#if !defined(WIN32)
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+static Param MakeParam(uint32_t v) {
+    Param p = {};
+    p.h.v = v;
+    p.val = (double)v;
+    return p;
+}
+
+// Whether the list holds exactly the handles that we expect, in order, and
+// finds each one of them.
+static bool HasExactly(IdList<Param,hParam> *l, std::vector<uint32_t> handles) {
+    std::sort(handles.begin(), handles.end());
+    if(l->n != (int)handles.size()) return false;
+    for(int i = 0; i < l->n; i++) {
+        if(l->Get(i).h.v != handles[i]) return false;
+    }
+    for(uint32_t v : handles) {
+        Param *p = l->FindByIdNoOops(hParam{ v });
+        if(p == nullptr || p->h.v != v || p->val != (double)v) return false;
+    }
+    return true;
+}
+
+TEST_CASE(add_out_of_order) {
+    // Mostly in order, as they usually come, but with some that belong
+    // before the end and have to be moved into place.
+    IdList<Param,hParam> l = {};
+    std::vector<uint32_t> handles;
+    for(uint32_t i = 0; i < 200; i++) {
+        uint32_t v = (i % 7 == 3) ? 5 * i + 1 : 5 * i + 1000;
+        Param p = MakeParam(v);
+        l.Add(&p);
+        handles.push_back(v);
+    }
+    CHECK_TRUE(HasExactly(&l, handles));
+    CHECK_TRUE(l.FindByIdNoOops(hParam{ 2 }) == nullptr);
+
+    // And AddAndAssignId() puts its item past all of those.
+    uint32_t last = l.Last()->h.v;
+    Param p = MakeParam(0);
+    hParam h = l.AddAndAssignId(&p);
+    CHECK_TRUE(h.v == last + 1);
+    CHECK_TRUE(l.Last()->h.v == h.v);
+    l.Clear();
+}
+
+TEST_CASE(bulk_add) {
+    // Some items already in the list, and then many more in any order,
+    // with handles both among and past those.
+    IdList<Param,hParam> l = {};
+    std::vector<uint32_t> handles;
+    for(uint32_t i = 0; i < 50; i++) {
+        Param p = MakeParam(10 * i);
+        l.Add(&p);
+        handles.push_back(10 * i);
+    }
+    std::vector<uint32_t> more;
+    for(uint32_t i = 0; i < 300; i++) {
+        more.push_back(i % 2 ? 10 * i + 5 : 1000 + 3 * i);
+    }
+    std::mt19937 rng(1);
+    std::shuffle(more.begin(), more.end(), rng);
+
+    uint32_t changes = l.Changes();
+    l.BeginBulkAdd();
+    for(uint32_t v : more) {
+        Param p = MakeParam(v);
+        l.Add(&p);
+        handles.push_back(v);
+    }
+    l.EndBulkAdd();
+    CHECK_TRUE(l.Changes() != changes);
+    CHECK_TRUE(HasExactly(&l, handles));
+
+    // An empty bulk add leaves the list as it was.
+    l.BeginBulkAdd();
+    l.EndBulkAdd();
+    CHECK_TRUE(HasExactly(&l, handles));
+    l.Clear();
+}
+
+TEST_CASE(index_lookups) {
+    // Enough items to index, in several buckets by the top half of their
+    // handles: one bucket with gaps in the low halves, and one left empty.
+    IdList<Param,hParam> l = {};
+    std::vector<uint32_t> handles;
+    for(uint32_t k = 0; k < 6; k++) {
+        if(k == 4) continue;
+        for(uint32_t i = 0; i < 40; i++) {
+            uint32_t v = (k << 16) + ((k == 2) ? 3 * i : i);
+            Param p = MakeParam(v);
+            l.Add(&p);
+            handles.push_back(v);
+        }
+    }
+    CHECK_TRUE(HasExactly(&l, handles));
+    for(uint32_t v : { 40u, 0xffffu, 0x20001u, 0x40000u, 0x40001u, 0x50028u, 0x70000u }) {
+        CHECK_TRUE(l.FindByIdNoOops(hParam{ v }) == nullptr);
+    }
+
+    // Adding at the end, past the last bucket, and in the middle of
+    // buckets, keeps the index right.
+    for(uint32_t v : { 0x60005u, 0xffffu, 0x20004u, 0x40000u }) {
+        Param p = MakeParam(v);
+        l.Add(&p);
+        handles.push_back(v);
+        CHECK_TRUE(HasExactly(&l, handles));
+    }
+
+    // Removing items, including a whole bucket.
+    std::vector<uint32_t> kept;
+    for(uint32_t v : handles) {
+        if(v % 3 != 0 && (v >> 16) != 3) kept.push_back(v);
+    }
+    int removed = l.RemoveIf([](Param &p) { return p.h.v % 3 == 0 || (p.h.v >> 16) == 3; });
+    CHECK_TRUE(removed == (int)(handles.size() - kept.size()));
+    CHECK_TRUE(HasExactly(&l, kept));
+    for(uint32_t v : handles) {
+        if(v % 3 == 0 || (v >> 16) == 3) {
+            CHECK_TRUE(l.FindByIdNoOops(hParam{ v }) == nullptr);
+        }
+    }
+
+    // Moving the items to another list, and then using both.
+    IdList<Param,hParam> m = {};
+    l.MoveSelfInto(&m);
+    CHECK_TRUE(HasExactly(&m, kept));
+    CHECK_TRUE(HasExactly(&l, {}));
+    std::vector<uint32_t> again;
+    for(uint32_t i = 0; i < 100; i++) {
+        Param p = MakeParam(0x30000 + i);
+        l.Add(&p);
+        again.push_back(0x30000 + i);
+    }
+    CHECK_TRUE(HasExactly(&l, again));
+    CHECK_TRUE(l.FindByIdNoOops(hParam{ kept[0] }) == nullptr);
+
+    IdList<Param,hParam> c = {};
+    m.DeepCopyInto(&c);
+    CHECK_TRUE(HasExactly(&c, kept));
+
+    l.Clear();
+    m.Clear();
+    c.Clear();
+}
+
+TEST_CASE(sparse_lookups) {
+    // Handles too far apart to index are still found.
+    IdList<Param,hParam> l = {};
+    std::vector<uint32_t> handles;
+    for(uint32_t i = 0; i < 100; i++) {
+        Param p = MakeParam((i << 24) + i);
+        l.Add(&p);
+        handles.push_back((i << 24) + i);
+    }
+    CHECK_TRUE(HasExactly(&l, handles));
+    CHECK_TRUE(l.FindByIdNoOops(hParam{ 1u << 24 }) == nullptr);
+    l.Clear();
+
+    // And so are handles appended far past an indexed list, like those of
+    // a group's entities after a request's.
+    std::vector<uint32_t> appended;
+    for(uint32_t i = 0; i < 100; i++) {
+        Param p = MakeParam(((i / 10) << 16) + i);
+        l.Add(&p);
+        appended.push_back(((i / 10) << 16) + i);
+    }
+    CHECK_TRUE(HasExactly(&l, appended));
+    for(uint32_t v : { 0x40000001u, 0x80020000u, 0x80020001u }) {
+        Param p = MakeParam(v);
+        l.Add(&p);
+        appended.push_back(v);
+        CHECK_TRUE(HasExactly(&l, appended));
+    }
+    CHECK_TRUE(l.FindByIdNoOops(hParam{ 0x40000000 }) == nullptr);
+    l.Clear();
+}
+
+#if !defined(WIN32)
+// Whether adding these handles in bulk, after the ones already in the list,
+// stops on a failed assertion.
+static bool BulkAddFails(std::vector<uint32_t> before, std::vector<uint32_t> added) {
+    pid_t pid = fork();
+    if(pid == 0) {
+        // Keep the failed assertion out of the test output.
+        dup2(open("/dev/null", O_WRONLY), 2);
+        IdList<Param,hParam> l = {};
+        for(uint32_t v : before) {
+            Param p = MakeParam(v);
+            l.Add(&p);
+        }
+        l.BeginBulkAdd();
+        for(uint32_t v : added) {
+            Param p = MakeParam(v);
+            l.Add(&p);
+        }
+        l.EndBulkAdd();
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+TEST_CASE(bulk_add_duplicate) {
+    // The handles are only checked at the end, but a duplicate is still
+    // caught, whether among the new items or with one from before.
+    CHECK_TRUE(!BulkAddFails({ 1, 2, 3 }, { 7, 5, 6, 4 }));
+    CHECK_TRUE(BulkAddFails({}, { 7, 5, 6, 5 }));
+    CHECK_TRUE(BulkAddFails({ 1, 2, 3 }, { 7, 2, 6 }));
+    CHECK_TRUE(BulkAddFails({ 1, 2, 3 }, { 3 }));
+}
+#endif
@@ -0,0 +1,496 @@
+#include "harness.h"
+
+// A triangle of three line segments, joined end to end with coincident
+// points. Side i goes from points[2*i] at corners[i] to points[2*i+1] at
+// corners[i+1], and its length is constrained to lengths[i].
+struct Triangle {
+    hEntity     points[6];
+    hConstraint sides[3];
+};
+
+static Triangle AddTriangle(const Vector corners[3], const double lengths[3]) {
+    Triangle t;
+    for(int i = 0; i < 3; i++) {
+        hRequest hr = SS.GW.AddRequest(Request::Type::LINE_SEGMENT,
+                                       /*rememberForUndo=*/false);
+        hEntity pa = hr.entity(1),
+                pb = hr.entity(2);
+        SK.GetEntity(pa)->PointForceTo(corners[i]);
+        SK.GetEntity(pb)->PointForceTo(corners[(i + 1) % 3]);
+        t.points[2*i]     = pa;
+        t.points[2*i + 1] = pb;
+        t.sides[i] = Constraint::Constrain(Constraint::Type::PT_PT_DISTANCE,
+                                           pa, pb, Entity::NO_ENTITY);
+        SK.GetConstraint(t.sides[i])->valA = lengths[i];
+        if(i > 0) {
+            Constraint::ConstrainCoincident(t.points[2*i - 1], pa);
+        }
+    }
+    Constraint::ConstrainCoincident(t.points[5], t.points[0]);
+    return t;
+}
+
+TEST_CASE(large_group) {
+    // A chain of 2500 line segments in the default workplane, each of fixed
+    // length and joined end to end; that's 10000 parameters in a single
+    // group, which is well past what a dense Jacobian could handle.
+    const int segments = 2500;
+    hEntity prev = Entity::NO_ENTITY;
+    hConstraint length = {};
+    for(int i = 0; i < segments; i++) {
+        hRequest hr = SS.GW.AddRequest(Request::Type::LINE_SEGMENT,
+                                       /*rememberForUndo=*/false);
+        hEntity ptA = hr.entity(1),
+                ptB = hr.entity(2);
+        SK.GetEntity(ptA)->PointForceTo(Vector::From(i * 10.0, (i % 2) * 1.0, 0));
+        SK.GetEntity(ptB)->PointForceTo(Vector::From(i * 10.0 + 9.0, 0.5, 0));
+
+        length = Constraint::Constrain(Constraint::Type::PT_PT_DISTANCE,
+                                       ptA, ptB, Entity::NO_ENTITY);
+        SK.GetConstraint(length)->valA = 10.0;
+        if(prev.v) {
+            Constraint::ConstrainCoincident(prev, ptA);
+        }
+        prev = ptB;
+    }
+    SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+
+    Group *g = SK.GetGroup(SS.GW.activeGroup);
+    CHECK_TRUE(g->solved.how == SolveResult::OKAY);
+    // Each segment has four parameters, less one length and, for all but
+    // the first, two coincidence equations.
+    CHECK_TRUE(g->solved.dof == 4 * segments - segments - 2 * (segments - 1));
+
+    Constraint *c = SK.GetConstraint(length);
+    Vector a = SK.GetEntity(c->ptA)->PointGetNum(),
+           b = SK.GetEntity(c->ptB)->PointGetNum();
+    CHECK_EQ_EPS(a.Minus(b).Magnitude(), 10.0);
+}
+
+TEST_CASE(independent_parts) {
+    // A segment of fixed length, and apart from it an impossible triangle;
+    // the triangle can't be solved, but that shouldn't stop the segment.
+    hRequest hr = SS.GW.AddRequest(Request::Type::LINE_SEGMENT,
+                                   /*rememberForUndo=*/false);
+    hEntity ptA = hr.entity(1),
+            ptB = hr.entity(2);
+    SK.GetEntity(ptA)->PointForceTo(Vector::From(0, 0, 0));
+    SK.GetEntity(ptB)->PointForceTo(Vector::From(9.0, 0.5, 0));
+    hConstraint length = Constraint::Constrain(Constraint::Type::PT_PT_DISTANCE,
+                                               ptA, ptB, Entity::NO_ENTITY);
+    SK.GetConstraint(length)->valA = 10.0;
+
+    Vector corners[3] = {
+        Vector::From(20.0, 0, 0), Vector::From(21.0, 0.5, 0), Vector::From(25.0, 3.0, 0)
+    };
+    double sides[3] = { 1.0, 1.0, 10.0 };
+    AddTriangle(corners, sides);
+    SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+
+    Group *g = SK.GetGroup(SS.GW.activeGroup);
+    CHECK_TRUE(g->solved.how == SolveResult::DIDNT_CONVERGE);
+
+    Vector a = SK.GetEntity(ptA)->PointGetNum(),
+           b = SK.GetEntity(ptB)->PointGetNum();
+    CHECK_EQ_EPS(a.Minus(b).Magnitude(), 10.0);
+}
+
+TEST_CASE(parallel_matches_serial) {
+    // Many separate triangles, each a system of its own once the corners are
+    // substituted, and enough of them to solve in parallel. Solving with one
+    // thread and with several should give exactly the same points.
+    const int triangles = 250;
+    std::vector<hEntity> points;
+    std::vector<Vector> initial;
+    for(int i = 0; i < triangles; i++) {
+        Vector corners[3] = {
+            Vector::From(i * 20.0, 0, 0),
+            Vector::From(i * 20.0 + 9.0, 0.5, 0),
+            Vector::From(i * 20.0 + 4.0, 7.0 + (i % 5), 0)
+        };
+        double sides[3] = { 10.0, 8.0 + (i % 3), 9.0 };
+        Triangle t = AddTriangle(corners, sides);
+        for(int j = 0; j < 6; j++) {
+            points.push_back(t.points[j]);
+            initial.push_back(corners[((j + 1) / 2) % 3]);
+        }
+    }
+    // The first solve after adding constraints checks the DOF without
+    // substitution; the ones after that are the ones we compare.
+    SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+
+    std::vector<Vector> solved[2];
+    unsigned threads[2] = { 1, 4 };
+    for(int k = 0; k < 2; k++) {
+        for(size_t i = 0; i < points.size(); i++) {
+            SK.GetEntity(points[i])->PointForceTo(initial[i]);
+        }
+        SS.sys.threads = threads[k];
+        SS.MarkGroupDirty(SS.GW.activeGroup);
+        SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+
+        Group *g = SK.GetGroup(SS.GW.activeGroup);
+        CHECK_TRUE(g->solved.how == SolveResult::OKAY);
+        CHECK_TRUE(g->solved.stats.substituted > 0);
+        for(hEntity hp : points) {
+            solved[k].push_back(SK.GetEntity(hp)->PointGetNum());
+        }
+    }
+    SS.sys.threads = 0;
+
+    for(size_t i = 0; i < points.size(); i++) {
+        CHECK_TRUE(solved[0][i].x == solved[1][i].x &&
+                   solved[0][i].y == solved[1][i].y &&
+                   solved[0][i].z == solved[1][i].z);
+    }
+}
+
+TEST_CASE(failed_leaves_points) {
+    // A triangle that solves, and then has a corner pulled apart and its
+    // sides made so they can't meet. The coincidences are solved by
+    // substitution this time, and the solve fails; so every point should
+    // stay where it was, including the ones that were substituted away.
+    Vector corners[3] = {
+        Vector::From(0, 0, 0), Vector::From(3.0, 0, 0), Vector::From(0, 4.0, 0)
+    };
+    double sides[3] = { 3.0, 5.0, 4.0 };
+    Triangle t = AddTriangle(corners, sides);
+    hEntity *points = t.points;
+    SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+
+    Group *g = SK.GetGroup(SS.GW.activeGroup);
+    CHECK_TRUE(g->solved.how == SolveResult::OKAY);
+
+    SK.GetEntity(points[1])->PointForceTo(Vector::From(3.5, 0.25, 0));
+    SK.GetEntity(points[4])->PointForceTo(Vector::From(-0.5, 4.25, 0));
+    SK.GetConstraint(t.sides[2])->valA = 10.0;
+    Vector before[6];
+    for(int i = 0; i < 6; i++) {
+        before[i] = SK.GetEntity(points[i])->PointGetNum();
+    }
+    SS.MarkGroupDirty(g->h);
+    SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+
+    g = SK.GetGroup(SS.GW.activeGroup);
+    CHECK_TRUE(g->solved.how == SolveResult::DIDNT_CONVERGE);
+    CHECK_TRUE(g->solved.stats.substituted > 0);
+    for(int i = 0; i < 6; i++) {
+        Vector after = SK.GetEntity(points[i])->PointGetNum();
+        CHECK_EQ_EPS(after.x, before[i].x);
+        CHECK_EQ_EPS(after.y, before[i].y);
+    }
+}
+
+TEST_CASE(damped) {
+    // A triangle whose corners start far from any solution, and then the
+    // same triangle with sides that can't meet; the damped solver should
+    // solve the first, and give up on the second.
+    Vector corners[3] = {
+        Vector::From(0, 0, 0), Vector::From(-3.0, 40.0, 0), Vector::From(0.5, 0.2, 0)
+    };
+    double lengths[3] = { 10.0, 11.0, 12.0 };
+    Triangle t = AddTriangle(corners, lengths);
+    hConstraint *sides = t.sides;
+
+    Group *g = SK.GetGroup(SS.GW.activeGroup);
+    g->dampedSolve = true;
+    SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+    g = SK.GetGroup(SS.GW.activeGroup);
+    CHECK_TRUE(g->solved.how == SolveResult::OKAY);
+    for(int i = 0; i < 3; i++) {
+        Constraint *c = SK.GetConstraint(sides[i]);
+        Vector a = SK.GetEntity(c->ptA)->PointGetNum(),
+               b = SK.GetEntity(c->ptB)->PointGetNum();
+        CHECK_EQ_EPS(a.Minus(b).Magnitude(), 10.0 + i);
+    }
+
+    SK.GetConstraint(sides[2])->valA = 30.0;
+    SS.MarkGroupDirty(g->h);
+    SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+    g = SK.GetGroup(SS.GW.activeGroup);
+    CHECK_TRUE(g->solved.how == SolveResult::DIDNT_CONVERGE);
+}
+
+TEST_CASE(redundant_found) {
+    // Two triangles, and the first side of one constrained again, from
+    // where it meets the second side; that's redundant with the side and the
+    // coincidence, and removing anything else won't help.
+    Vector corners[3] = {
+        Vector::From(0, 0, 0), Vector::From(10.0, 0.5, 0), Vector::From(1.0, 12.0, 0)
+    };
+    double lengths[3] = { 10.0, 11.0, 12.0 };
+    Triangle t = AddTriangle(corners, lengths);
+    for(int i = 0; i < 3; i++) {
+        corners[i] = corners[i].Plus(Vector::From(50.0, 0, 0));
+    }
+    Triangle u = AddTriangle(corners, lengths);
+    hConstraint again = Constraint::Constrain(Constraint::Type::PT_PT_DISTANCE,
+                                              t.points[0], t.points[2],
+                                              Entity::NO_ENTITY);
+    SK.GetConstraint(again)->valA = 10.0;
+    SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+
+    Group *g = SK.GetGroup(SS.GW.activeGroup);
+    CHECK_TRUE(g->solved.how == SolveResult::REDUNDANT_OKAY);
+    List<hConstraint> *remove = &g->solved.remove;
+    auto removes = [&](hConstraint hc) {
+        return std::find(remove->begin(), remove->end(), hc) != remove->end();
+    };
+    CHECK_TRUE(remove->n == 3);
+    CHECK_TRUE(removes(t.sides[0]));
+    CHECK_TRUE(removes(again));
+    for(int i = 1; i < 3; i++) {
+        CHECK_TRUE(!removes(t.sides[i]));
+    }
+    for(int i = 0; i < 3; i++) {
+        CHECK_TRUE(!removes(u.sides[i]));
+    }
+    // And the coincidence comes last.
+    Constraint *c = SK.GetConstraint(remove->Get(2));
+    CHECK_TRUE(c->type == Constraint::Type::POINTS_COINCIDENT);
+    CHECK_TRUE(c->ptA == t.points[1] && c->ptB == t.points[2]);
+}
+
+TEST_CASE(stats) {
+    // Two segments of fixed length, joined end to end; the coincidence is
+    // solved by substitution, and the lengths take some Newton steps.
+    hRequest hr = SS.GW.AddRequest(Request::Type::LINE_SEGMENT,
+                                   /*rememberForUndo=*/false),
+             hs = SS.GW.AddRequest(Request::Type::LINE_SEGMENT,
+                                   /*rememberForUndo=*/false);
+    SK.GetEntity(hr.entity(1))->PointForceTo(Vector::From(0, 0, 0));
+    SK.GetEntity(hr.entity(2))->PointForceTo(Vector::From(9.0, 0.5, 0));
+    SK.GetEntity(hs.entity(1))->PointForceTo(Vector::From(9.0, 0.5, 0));
+    SK.GetEntity(hs.entity(2))->PointForceTo(Vector::From(9.5, 12.0, 0));
+    hConstraint lengths[2] = {
+        Constraint::Constrain(Constraint::Type::PT_PT_DISTANCE,
+                              hr.entity(1), hr.entity(2), Entity::NO_ENTITY),
+        Constraint::Constrain(Constraint::Type::PT_PT_DISTANCE,
+                              hs.entity(1), hs.entity(2), Entity::NO_ENTITY),
+    };
+    for(hConstraint hc : lengths) {
+        SK.GetConstraint(hc)->valA = 10.0;
+    }
+    Constraint::ConstrainCoincident(hr.entity(2), hs.entity(1));
+    SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+
+    // The first solve after adding constraints checks the DOF without
+    // substitution, so change a length to solve again.
+    Group *g = SK.GetGroup(SS.GW.activeGroup);
+    CHECK_TRUE(g->solved.how == SolveResult::OKAY);
+    SK.GetConstraint(lengths[1])->valA = 12.0;
+    SS.MarkGroupDirty(g->h);
+    SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+
+    g = SK.GetGroup(SS.GW.activeGroup);
+    CHECK_TRUE(g->solved.how == SolveResult::OKAY);
+    const SolveStats &st = g->solved.stats;
+    CHECK_TRUE(st.equations >= 4);
+    CHECK_TRUE(st.params >= 8);
+    CHECK_TRUE(st.substituted >= 2);
+    CHECK_TRUE(!st.residual.empty());
+    CHECK_TRUE((int)st.residual.size() <= st.iterations + 1);
+    CHECK_TRUE(st.residual.back() < LENGTH_EPS);
+    CHECK_TRUE(st.totalTime >= 0.0);
+}
+
+TEST_CASE(free_params) {
+    // A segment locked at one end, horizontal and of fixed length, so none
+    // of its params are free; and beside it a segment that's only horizontal,
+    // which has three degrees of freedom but all four of its params free.
+    hRequest hr = SS.GW.AddRequest(Request::Type::LINE_SEGMENT,
+                                   /*rememberForUndo=*/false),
+             hs = SS.GW.AddRequest(Request::Type::LINE_SEGMENT,
+                                   /*rememberForUndo=*/false);
+    SK.GetEntity(hr.entity(1))->PointForceTo(Vector::From(0, 0, 0));
+    SK.GetEntity(hr.entity(2))->PointForceTo(Vector::From(9.0, 0.5, 0));
+    SK.GetEntity(hs.entity(1))->PointForceTo(Vector::From(0, 5.0, 0));
+    SK.GetEntity(hs.entity(2))->PointForceTo(Vector::From(9.0, 6.0, 0));
+    Constraint::Constrain(Constraint::Type::WHERE_DRAGGED,
+                          hr.entity(1), Entity::NO_ENTITY, Entity::NO_ENTITY);
+    hConstraint length = Constraint::Constrain(Constraint::Type::PT_PT_DISTANCE,
+                                               hr.entity(1), hr.entity(2),
+                                               Entity::NO_ENTITY);
+    SK.GetConstraint(length)->valA = 10.0;
+    Constraint::Constrain(Constraint::Type::HORIZONTAL,
+                          Entity::NO_ENTITY, Entity::NO_ENTITY, hr.entity(0));
+    Constraint::Constrain(Constraint::Type::HORIZONTAL,
+                          Entity::NO_ENTITY, Entity::NO_ENTITY, hs.entity(0));
+    SS.GenerateAll(SolveSpaceUI::Generate::ALL, /*andFindFree=*/true);
+
+    Group *g = SK.GetGroup(SS.GW.activeGroup);
+    CHECK_TRUE(g->solved.how == SolveResult::OKAY);
+    CHECK_TRUE(g->solved.dof == 3);
+    for(int i = 1; i <= 2; i++) {
+        Entity *bound = SK.GetEntity(hr.entity(i)),
+               *free  = SK.GetEntity(hs.entity(i));
+        for(int j = 0; j < 2; j++) {
+            CHECK_TRUE(!SK.GetParam(bound->param[j])->free);
+            CHECK_TRUE(SK.GetParam(free->param[j])->free);
+        }
+    }
+
+    // Solving again with substitution counts the same degrees of freedom.
+    SS.MarkGroupDirty(g->h);
+    SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+    g = SK.GetGroup(SS.GW.activeGroup);
+    CHECK_TRUE(g->solved.how == SolveResult::OKAY);
+    CHECK_TRUE(g->solved.dof == 3);
+}
+
+TEST_CASE(prune_dependents) {
+    // A hub segment, and many spokes with a length measured from one end of
+    // the hub; deleting the hub should take all of those lengths with it,
+    // and leave the spokes.
+    const int spokes = 200;
+    hRequest hub = SS.GW.AddRequest(Request::Type::LINE_SEGMENT,
+                                    /*rememberForUndo=*/false);
+    SK.GetEntity(hub.entity(1))->PointForceTo(Vector::From(0, 0, 0));
+    SK.GetEntity(hub.entity(2))->PointForceTo(Vector::From(1.0, 0, 0));
+    for(int i = 0; i < spokes; i++) {
+        hRequest hs = SS.GW.AddRequest(Request::Type::LINE_SEGMENT,
+                                       /*rememberForUndo=*/false);
+        double a = 2 * PI * i / spokes;
+        SK.GetEntity(hs.entity(1))->PointForceTo(Vector::From(2 * cos(a), 2 * sin(a), 0));
+        SK.GetEntity(hs.entity(2))->PointForceTo(Vector::From(5 * cos(a), 5 * sin(a), 0));
+        hConstraint length = Constraint::Constrain(Constraint::Type::PT_PT_DISTANCE,
+                                                   hub.entity(1), hs.entity(2),
+                                                   Entity::NO_ENTITY);
+        SK.GetConstraint(length)->valA = 5.0;
+    }
+    SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+    CHECK_TRUE(SK.constraint.n == spokes);
+
+    SK.request.RemoveById(hub);
+    SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+    CHECK_TRUE(SK.constraint.n == 0);
+    CHECK_TRUE(SK.request.FindByIdNoOops(hub) == NULL);
+    CHECK_TRUE(SK.entity.FindByIdNoOops(hub.entity(1)) == NULL);
+    int segments = 0;
+    for(Request &r : SK.request) {
+        if(r.type != Request::Type::LINE_SEGMENT) continue;
+        CHECK_TRUE(SK.entity.FindByIdNoOops(r.h.entity(2)) != NULL);
+        segments++;
+    }
+    CHECK_TRUE(segments == spokes);
+    Group *g = SK.GetGroup(SS.GW.activeGroup);
+    CHECK_TRUE(g->solved.how == SolveResult::OKAY);
+}
+
+TEST_CASE(prune_keeps_constraint_params) {
+    // A point on a line has a param of its constraint's own, which has a
+    // handle that looks like one from request 0x4000; so pruning that
+    // request, here one in a workplane that doesn't exist, shouldn't
+    // take the constraint's param with it.
+    hRequest hr = SS.GW.AddRequest(Request::Type::LINE_SEGMENT,
+                                   /*rememberForUndo=*/false),
+             hs = SS.GW.AddRequest(Request::Type::LINE_SEGMENT,
+                                   /*rememberForUndo=*/false);
+    SK.GetEntity(hr.entity(1))->PointForceTo(Vector::From(0, 0, 0));
+    SK.GetEntity(hr.entity(2))->PointForceTo(Vector::From(10.0, 0, 0));
+    SK.GetEntity(hs.entity(1))->PointForceTo(Vector::From(4.0, 1.0, 0));
+    SK.GetEntity(hs.entity(2))->PointForceTo(Vector::From(4.0, 5.0, 0));
+    hConstraint on = Constraint::Constrain(Constraint::Type::PT_ON_LINE,
+                                           hs.entity(1), Entity::NO_ENTITY,
+                                           hr.entity(0));
+    CHECK_TRUE(on.param(0).request().v == 0x4000);
+
+    Request orphan = {};
+    orphan.h.v       = 0x4000;
+    orphan.type      = Request::Type::LINE_SEGMENT;
+    orphan.group     = SS.GW.activeGroup;
+    orphan.workplane = hEntity{ 0x3fff0000 };
+    SK.request.Add(&orphan);
+    SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+
+    CHECK_TRUE(SK.request.FindByIdNoOops(orphan.h) == NULL);
+    CHECK_TRUE(SK.param.FindByIdNoOops(on.param(0)) != NULL);
+    Group *g = SK.GetGroup(SS.GW.activeGroup);
+    CHECK_TRUE(g->solved.how == SolveResult::OKAY);
+    Vector a = SK.GetEntity(hr.entity(1))->PointGetNum(),
+           b = SK.GetEntity(hr.entity(2))->PointGetNum(),
+           p = SK.GetEntity(hs.entity(1))->PointGetNum();
+    CHECK_EQ_EPS(p.DistanceToLine(a, b.Minus(a)), 0.0);
+}
+
+TEST_CASE(structure_reuse) {
+    // A segment of fixed length; moving a point keeps the structure, and
+    // the equations too, and changing the length keeps the structure but
+    // compiles its system again; but adding or removing a constraint has
+    // to rebuild it.
+    hRequest hr = SS.GW.AddRequest(Request::Type::LINE_SEGMENT,
+                                   /*rememberForUndo=*/false);
+    hEntity pa = hr.entity(1),
+            pb = hr.entity(2);
+    SK.GetEntity(pa)->PointForceTo(Vector::From(0, 0, 0));
+    SK.GetEntity(pb)->PointForceTo(Vector::From(9.0, 3.0, 0));
+    hConstraint length = Constraint::Constrain(Constraint::Type::PT_PT_DISTANCE,
+                                               pa, pb, Entity::NO_ENTITY);
+    SK.GetConstraint(length)->valA = 10.0;
+    SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+
+    auto resolve = [&]() {
+        Group *g = SK.GetGroup(SS.GW.activeGroup);
+        SS.MarkGroupDirty(g->h);
+        SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+        return SK.GetGroup(SS.GW.activeGroup);
+    };
+    auto lengthIs = [&](double d) {
+        Vector a = SK.GetEntity(pa)->PointGetNum(),
+               b = SK.GetEntity(pb)->PointGetNum();
+        CHECK_EQ_EPS(a.Minus(b).Magnitude(), d);
+    };
+    resolve();
+    SK.GetEntity(pb)->PointForceTo(Vector::From(3.0, 9.0, 0));
+    Group *g = resolve();
+    CHECK_TRUE(g->solved.how == SolveResult::OKAY);
+    CHECK_TRUE(g->solved.stats.reused);
+    CHECK_TRUE(g->solved.stats.unchanged);
+    CHECK_TRUE(g->solved.stats.recompiled == 0);
+    lengthIs(10.0);
+
+    SK.GetConstraint(length)->valA = 12.0;
+    g = resolve();
+    CHECK_TRUE(g->solved.how == SolveResult::OKAY);
+    CHECK_TRUE(g->solved.stats.reused);
+    CHECK_TRUE(!g->solved.stats.unchanged);
+    CHECK_TRUE(g->solved.stats.recompiled == 1);
+    lengthIs(12.0);
+
+    // And the new length stays compiled in.
+    SK.GetEntity(pb)->PointForceTo(Vector::From(9.0, 3.0, 0));
+    g = resolve();
+    CHECK_TRUE(g->solved.how == SolveResult::OKAY);
+    CHECK_TRUE(g->solved.stats.unchanged);
+    lengthIs(12.0);
+
+    hConstraint horiz = Constraint::Constrain(Constraint::Type::HORIZONTAL,
+                                              Entity::NO_ENTITY, Entity::NO_ENTITY,
+                                              hr.entity(0));
+    g = resolve();
+    CHECK_TRUE(g->solved.how == SolveResult::OKAY);
+    CHECK_TRUE(!g->solved.stats.reused);
+    lengthIs(12.0);
+    CHECK_EQ_EPS(SK.GetEntity(pa)->PointGetNum().y, SK.GetEntity(pb)->PointGetNum().y);
+
+    SK.constraint.RemoveById(horiz);
+    SK.GetEntity(pb)->PointForceTo(Vector::From(0, 20.0, 0));
+    g = resolve();
+    CHECK_TRUE(g->solved.how == SolveResult::OKAY);
+    CHECK_TRUE(!g->solved.stats.reused);
+    lengthIs(12.0);
+}
+
+TEST_CASE(structure_forgotten) {
+    // The solver keeps the structure of the groups that it just solved,
+    // and no others.
+    hRequest hr = SS.GW.AddRequest(Request::Type::LINE_SEGMENT,
+                                   /*rememberForUndo=*/false);
+    SK.GetEntity(hr.entity(1))->PointForceTo(Vector::From(0, 0, 0));
+    SK.GetEntity(hr.entity(2))->PointForceTo(Vector::From(9.0, 3.0, 0));
+    SS.sys.structure[0x7fff0000];
+    SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+
+    CHECK_TRUE(SS.sys.structure.count(0x7fff0000) == 0);
+    CHECK_TRUE(SS.sys.structure.count(SS.GW.activeGroup.v) == 1);
+}
@@ -0,0 +1,60 @@
+#include "harness.h"
+
+static Vector PointOf(hEntity he) {
+    return SK.GetEntity(he)->PointGetNum();
+}
+
+TEST_CASE(undo_redo) {
+    hRequest ha = SS.GW.AddRequest(Request::Type::LINE_SEGMENT,
+                                   /*rememberForUndo=*/false);
+    SK.GetEntity(ha.entity(1))->PointForceTo(Vector::From(0, 0, 0));
+    SK.GetEntity(ha.entity(2))->PointForceTo(Vector::From(10.0, 0, 0));
+    SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+    SS.UndoRemember();
+
+    hRequest hb = SS.GW.AddRequest(Request::Type::LINE_SEGMENT,
+                                   /*rememberForUndo=*/false);
+    SK.GetEntity(hb.entity(1))->PointForceTo(Vector::From(0, 5.0, 0));
+    SK.GetEntity(hb.entity(2))->PointForceTo(Vector::From(10.0, 5.0, 0));
+    SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+    SS.UndoRemember();
+    CHECK_TRUE(SS.undo.size() == 2);
+
+    // The first segment didn't change between those, so it's only held once.
+    auto heldFor = [&](const SolveSpaceUI::UndoState &ut, hRequest hr) {
+        for(const auto &r : *ut.request) {
+            if(r->h == hr) return r.get();
+        }
+        return (const Request *)NULL;
+    };
+    CHECK_TRUE(heldFor(SS.undo[0], ha) != NULL);
+    CHECK_TRUE(heldFor(SS.undo[0], ha) == heldFor(SS.undo[1], ha));
+    CHECK_TRUE(heldFor(SS.undo[0], hb) == NULL);
+    // And lists that didn't change at all are held once as a whole.
+    CHECK_TRUE(SS.undo[0].request != SS.undo[1].request);
+    CHECK_TRUE(SS.undo[0].style == SS.undo[1].style);
+    CHECK_TRUE(SS.undo[0].groupOrder == SS.undo[1].groupOrder);
+
+    SK.GetEntity(hb.entity(2))->PointForceTo(Vector::From(20.0, 5.0, 0));
+    SS.GenerateAll(SolveSpaceUI::Generate::ALL);
+
+    SS.UndoUndo();
+    CHECK_TRUE(SS.redo.size() == 1);
+    CHECK_TRUE(PointOf(hb.entity(2)).Equals(Vector::From(10.0, 5.0, 0)));
+
+    SS.UndoUndo();
+    CHECK_TRUE(SS.undo.empty());
+    CHECK_TRUE(SK.request.FindByIdNoOops(hb) == NULL);
+    CHECK_TRUE(PointOf(ha.entity(2)).Equals(Vector::From(10.0, 0, 0)));
+
+    SS.UndoRedo();
+    CHECK_TRUE(SK.request.FindByIdNoOops(hb) != NULL);
+    CHECK_TRUE(PointOf(hb.entity(2)).Equals(Vector::From(10.0, 5.0, 0)));
+
+    SS.UndoRedo();
+    CHECK_TRUE(SS.redo.empty());
+    CHECK_TRUE(PointOf(hb.entity(2)).Equals(Vector::From(20.0, 5.0, 0)));
+
+    SS.UndoClearStack(&SS.undo);
+    CHECK_TRUE(SS.undoBytes == 0);
+}
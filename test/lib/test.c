@@ -0,0 +1,298 @@
+/* Tests for the solver library, through its C interface. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <slvs.h>
+
+static int failures = 0;
+
+#define CHECK_TRUE(cond) do { \
+        if(!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while(0)
+
+static void *CheckMalloc(size_t n)
+{
+    void *r = calloc(n, 1);
+    if(!r) {
+        fprintf(stderr, "out of memory!\n");
+        exit(-1);
+    }
+    return r;
+}
+
+static double Abs(double x)
+{
+    return x < 0 ? -x : x;
+}
+
+/* A chain of horizontal line segments in a workplane, each of length
+ * given by a point-point distance constraint; group 1 is the workplane,
+ * and group 2 the chain. */
+static void MakeChain(Slvs_System *sys, int segments)
+{
+    double qw, qx, qy, qz;
+    int i;
+
+    memset(sys, 0, sizeof(*sys));
+    sys->param      = CheckMalloc((8 + 2*(segments + 1))*sizeof(Slvs_Param));
+    sys->entity     = CheckMalloc((3 + 2*segments + 1)*sizeof(Slvs_Entity));
+    sys->constraint = CheckMalloc((2*segments + 1)*sizeof(Slvs_Constraint));
+
+    sys->param[sys->params++] = Slvs_MakeParam(1, 1, 0.0);
+    sys->param[sys->params++] = Slvs_MakeParam(2, 1, 0.0);
+    sys->param[sys->params++] = Slvs_MakeParam(3, 1, 0.0);
+    sys->entity[sys->entities++] = Slvs_MakePoint3d(101, 1, 1, 2, 3);
+    Slvs_MakeQuaternion(1, 0, 0, 0, 1, 0, &qw, &qx, &qy, &qz);
+    sys->param[sys->params++] = Slvs_MakeParam(4, 1, qw);
+    sys->param[sys->params++] = Slvs_MakeParam(5, 1, qx);
+    sys->param[sys->params++] = Slvs_MakeParam(6, 1, qy);
+    sys->param[sys->params++] = Slvs_MakeParam(7, 1, qz);
+    sys->entity[sys->entities++] = Slvs_MakeNormal3d(102, 1, 4, 5, 6, 7);
+    sys->entity[sys->entities++] = Slvs_MakeWorkplane(200, 1, 101, 102);
+
+    /* The first point is in group 1, so it's fixed. */
+    sys->param[sys->params++] = Slvs_MakeParam(11, 1, 0.0);
+    sys->param[sys->params++] = Slvs_MakeParam(12, 1, 0.0);
+    sys->entity[sys->entities++] = Slvs_MakePoint2d(300, 1, 200, 11, 12);
+    for(i = 1; i <= segments; i++) {
+        Slvs_hParam u = 11 + 2*i, v = 12 + 2*i;
+        sys->param[sys->params++] = Slvs_MakeParam(u, 2, i*9.0);
+        sys->param[sys->params++] = Slvs_MakeParam(v, 2, (i % 3)*0.5);
+        sys->entity[sys->entities++] = Slvs_MakePoint2d(300 + i, 2, 200, u, v);
+        sys->entity[sys->entities++] = Slvs_MakeLineSegment(1000 + i, 2, 200,
+                                            300 + i - 1, 300 + i);
+        sys->constraint[sys->constraints++] = Slvs_MakeConstraint(
+            i, 2, SLVS_C_PT_PT_DISTANCE, 200, 10.0, 300 + i - 1, 300 + i, 0, 0);
+        sys->constraint[sys->constraints++] = Slvs_MakeConstraint(
+            1000 + i, 2, SLVS_C_HORIZONTAL, 200, 0.0, 0, 0, 1000 + i, 0);
+    }
+
+    sys->failed  = CheckMalloc(sys->constraints*sizeof(Slvs_hConstraint));
+    sys->faileds = sys->constraints;
+}
+
+static void FreeSystem(Slvs_System *sys)
+{
+    free(sys->param);
+    free(sys->entity);
+    free(sys->constraint);
+    free(sys->failed);
+}
+
+/* Solve a batch that sets the length of every segment; and check each
+ * scenario against solving it alone. The library adds a param for each
+ * of those constraints, enough that its list of params has to grow. */
+static void TestBatch(void)
+{
+    const int segments = 90, scenarios = 40;
+    Slvs_System sys;
+    Slvs_Param *initial;
+    Slvs_Batch batch;
+    int i, j;
+
+    MakeChain(&sys, segments);
+    memset(&batch, 0, sizeof(batch));
+    batch.scenarios     = scenarios;
+    batch.constraints   = segments;
+    batch.constraint    = CheckMalloc(segments*sizeof(Slvs_hConstraint));
+    batch.constraintVal = CheckMalloc(scenarios*segments*sizeof(double));
+    batch.solution      = CheckMalloc(scenarios*sys.params*sizeof(double));
+    batch.result        = CheckMalloc(scenarios*sizeof(int));
+    for(j = 0; j < segments; j++) {
+        batch.constraint[j] = j + 1;
+        for(i = 0; i < scenarios; i++) {
+            batch.constraintVal[i*segments + j] = 10.0 + 0.1*i + 0.01*j;
+        }
+    }
+    Slvs_SolveBatch(&sys, 2, &batch);
+
+    initial = CheckMalloc(sys.params*sizeof(Slvs_Param));
+    memcpy(initial, sys.param, sys.params*sizeof(Slvs_Param));
+    for(i = 0; i < scenarios; i++) {
+        double x = 0;
+        memcpy(sys.param, initial, sys.params*sizeof(Slvs_Param));
+        for(j = 0; j < segments; j++) {
+            sys.constraint[2*j].valA = batch.constraintVal[i*segments + j];
+        }
+        Slvs_Solve(&sys, 2);
+
+        CHECK_TRUE(batch.result[i] == SLVS_RESULT_OKAY);
+        CHECK_TRUE(sys.result == SLVS_RESULT_OKAY);
+        for(j = 0; j < sys.params; j++) {
+            CHECK_TRUE(Abs(batch.solution[i*sys.params + j] - sys.param[j].val) < 1e-6);
+        }
+        /* The last point is at the sum of the lengths. */
+        for(j = 0; j < segments; j++) {
+            x += batch.constraintVal[i*segments + j];
+        }
+        CHECK_TRUE(Abs(batch.solution[i*sys.params + sys.params - 2] - x) < 1e-6);
+    }
+
+    /* A batch that refers to a missing constraint still gets a result,
+     * and a solution, for every scenario. */
+    batch.constraint[segments - 1] = 9999;
+    for(i = 0; i < scenarios; i++) {
+        batch.result[i] = -1;
+        batch.solution[i*sys.params] = -1;
+    }
+    Slvs_SolveBatch(&sys, 2, &batch);
+    for(i = 0; i < scenarios; i++) {
+        CHECK_TRUE(batch.result[i] == SLVS_RESULT_INVALID);
+        CHECK_TRUE(batch.solution[i*sys.params] == sys.param[0].val);
+    }
+
+    free(initial);
+    free(batch.constraint);
+    free(batch.constraintVal);
+    free(batch.solution);
+    free(batch.result);
+    FreeSystem(&sys);
+}
+
+/* A line segment in a workplane, with room for a few constraints on it;
+ * group 1 is the workplane, and group 2 the segment, from (1, 2) to (5, 2). */
+static void MakeSegment(Slvs_System *sys)
+{
+    double qw, qx, qy, qz;
+
+    memset(sys, 0, sizeof(*sys));
+    sys->param      = CheckMalloc(11*sizeof(Slvs_Param));
+    sys->entity     = CheckMalloc(6*sizeof(Slvs_Entity));
+    sys->constraint = CheckMalloc(4*sizeof(Slvs_Constraint));
+    sys->failed     = CheckMalloc(4*sizeof(Slvs_hConstraint));
+    sys->faileds    = 4;
+
+    sys->param[sys->params++] = Slvs_MakeParam(1, 1, 0.0);
+    sys->param[sys->params++] = Slvs_MakeParam(2, 1, 0.0);
+    sys->param[sys->params++] = Slvs_MakeParam(3, 1, 0.0);
+    sys->entity[sys->entities++] = Slvs_MakePoint3d(101, 1, 1, 2, 3);
+    Slvs_MakeQuaternion(1, 0, 0, 0, 1, 0, &qw, &qx, &qy, &qz);
+    sys->param[sys->params++] = Slvs_MakeParam(4, 1, qw);
+    sys->param[sys->params++] = Slvs_MakeParam(5, 1, qx);
+    sys->param[sys->params++] = Slvs_MakeParam(6, 1, qy);
+    sys->param[sys->params++] = Slvs_MakeParam(7, 1, qz);
+    sys->entity[sys->entities++] = Slvs_MakeNormal3d(102, 1, 4, 5, 6, 7);
+    sys->entity[sys->entities++] = Slvs_MakeWorkplane(200, 1, 101, 102);
+
+    sys->param[sys->params++] = Slvs_MakeParam(11, 2, 1.0);
+    sys->param[sys->params++] = Slvs_MakeParam(12, 2, 2.0);
+    sys->param[sys->params++] = Slvs_MakeParam(13, 2, 5.0);
+    sys->param[sys->params++] = Slvs_MakeParam(14, 2, 2.0);
+    sys->entity[sys->entities++] = Slvs_MakePoint2d(301, 2, 200, 11, 12);
+    sys->entity[sys->entities++] = Slvs_MakePoint2d(302, 2, 200, 13, 14);
+    sys->entity[sys->entities++] = Slvs_MakeLineSegment(400, 2, 200, 301, 302);
+}
+
+/* The same point dragged twice, and the same line made horizontal twice.
+ * The second horizontal constraint is solved by substituting the param
+ * with itself, which holds it; so taking away either drag still leaves the
+ * other one redundant, and there's no one constraint to remove. */
+static void TestRedundantSubstitution(void)
+{
+    Slvs_System sys;
+
+    MakeSegment(&sys);
+    sys.constraint[sys.constraints++] = Slvs_MakeConstraint(
+        1, 2, SLVS_C_WHERE_DRAGGED, 200, 0.0, 301, 0, 0, 0);
+    sys.constraint[sys.constraints++] = Slvs_MakeConstraint(
+        2, 2, SLVS_C_WHERE_DRAGGED, 200, 0.0, 301, 0, 0, 0);
+    sys.constraint[sys.constraints++] = Slvs_MakeConstraint(
+        3, 2, SLVS_C_HORIZONTAL, 200, 0.0, 0, 0, 400, 0);
+    sys.constraint[sys.constraints++] = Slvs_MakeConstraint(
+        4, 2, SLVS_C_HORIZONTAL, 200, 0.0, 0, 0, 400, 0);
+    sys.calculateFaileds = 1;
+    Slvs_Solve(&sys, 2);
+
+    CHECK_TRUE(sys.result == SLVS_RESULT_INCONSISTENT);
+    CHECK_TRUE(sys.faileds == 0);
+    FreeSystem(&sys);
+}
+
+/* Two points made coincident, and also a distance of zero apart; taking
+ * away either constraint fixes it. */
+static void TestCoincidentAndZeroDistance(void)
+{
+    Slvs_System sys;
+    int i, found[2] = { 0, 0 };
+
+    MakeSegment(&sys);
+    sys.constraint[sys.constraints++] = Slvs_MakeConstraint(
+        1, 2, SLVS_C_POINTS_COINCIDENT, 200, 0.0, 301, 302, 0, 0);
+    sys.constraint[sys.constraints++] = Slvs_MakeConstraint(
+        2, 2, SLVS_C_PT_PT_DISTANCE, 200, 0.0, 301, 302, 0, 0);
+    sys.calculateFaileds = 1;
+    Slvs_Solve(&sys, 2);
+
+    CHECK_TRUE(sys.result == SLVS_RESULT_INCONSISTENT);
+    CHECK_TRUE(sys.faileds == 2);
+    for(i = 0; i < sys.faileds && i < 2; i++) {
+        if(sys.failed[i] == 1 || sys.failed[i] == 2) found[sys.failed[i] - 1] = 1;
+    }
+    CHECK_TRUE(found[0] && found[1]);
+    FreeSystem(&sys);
+}
+
+/* Handles that aren't loaded are reported, rather than stopping the host,
+ * and leave the system as it was. */
+static void TestInvalidHandles(void)
+{
+    Slvs_System sys;
+    Slvs_Context *ctx;
+    Slvs_Constraint c;
+    double val = 0;
+
+    MakeSegment(&sys);
+    sys.constraint[sys.constraints++] = Slvs_MakeConstraint(
+        1, 2, SLVS_C_HORIZONTAL, 200, 0.0, 0, 0, 400, 0);
+    ctx = Slvs_CreateContext();
+    CHECK_TRUE(Slvs_LoadSystem(ctx, &sys) == SLVS_RESULT_OKAY);
+
+    CHECK_TRUE(Slvs_SetParam(ctx, 99, 1.0) == SLVS_RESULT_INVALID);
+    CHECK_TRUE(Slvs_GetParam(ctx, 99, &val) == SLVS_RESULT_INVALID);
+    CHECK_TRUE(Slvs_RemoveConstraint(ctx, 99) == SLVS_RESULT_INVALID);
+    c = Slvs_MakeConstraint(2, 2, SLVS_C_PT_PT_DISTANCE, 200, 3.0, 301, 399, 0, 0);
+    CHECK_TRUE(Slvs_AddConstraint(ctx, &c) == SLVS_RESULT_INVALID);
+    c = Slvs_MakeConstraint(1, 2, SLVS_C_PT_PT_DISTANCE, 200, 3.0, 301, 302, 0, 0);
+    CHECK_TRUE(Slvs_AddConstraint(ctx, &c) == SLVS_RESULT_INVALID);
+
+    c.h = 2;
+    CHECK_TRUE(Slvs_AddConstraint(ctx, &c) == SLVS_RESULT_OKAY);
+    CHECK_TRUE(Slvs_SetParam(ctx, 14, 4.0) == SLVS_RESULT_OKAY);
+    Slvs_SolveLoaded(ctx, &sys, 2);
+    CHECK_TRUE(sys.result == SLVS_RESULT_OKAY);
+    CHECK_TRUE(Slvs_GetParam(ctx, 13, &val) == SLVS_RESULT_OKAY);
+    CHECK_TRUE(Abs(Abs(val - sys.param[7].val) - 3.0) < 1e-6);
+
+    /* And a system that refers to a missing entity isn't loaded or solved. */
+    sys.constraint[0].entityA = 499;
+    CHECK_TRUE(Slvs_LoadSystem(ctx, &sys) == SLVS_RESULT_INVALID);
+    CHECK_TRUE(Slvs_GetParam(ctx, 13, &val) == SLVS_RESULT_INVALID);
+    sys.result = -1;
+    Slvs_Solve(&sys, 2);
+    CHECK_TRUE(sys.result == SLVS_RESULT_INVALID);
+    sys.constraint[0].entityA = 400;
+    sys.entity[5].point[1] = 399;
+    Slvs_Solve(&sys, 2);
+    CHECK_TRUE(sys.result == SLVS_RESULT_INVALID);
+
+    Slvs_DestroyContext(ctx);
+    FreeSystem(&sys);
+}
+
+int main()
+{
+    TestBatch();
+    TestRedundantSubstitution();
+    TestCoincidentAndZeroDistance();
+    TestInvalidHandles();
+
+    if(failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("Success!\n");
+    return 0;
+}